@@ -0,0 +1,536 @@
+#include <ctime>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <dirent.h>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+
+#include "helperfunctions.hpp"
+#include "timestamp.hpp"
+#include "kufar.hpp"
+#include "telegram.hpp"
+#include "seenadstore.hpp"
+#include "cachejournal.hpp"
+
+#ifndef ADS_SCANNER_FIXTURE_DIR
+#define ADS_SCANNER_FIXTURE_DIR "bench/fixtures"
+#endif
+
+using namespace std;
+using nlohmann::json;
+using namespace Kufar;
+
+namespace {
+    // Keeps results alive so the optimizer cannot drop the measured work.
+    volatile int64_t g_sink = 0;
+
+    struct Options {
+        // Only benchmarks whose name contains this run.
+        string filter;
+        bool jsonOutput = false;
+        string fixtureDirectory = ADS_SCANNER_FIXTURE_DIR;
+    };
+
+    struct Result {
+        string name;
+        size_t iterations = 0;
+        double nanosecondsPerOp = 0;
+        size_t itemsPerOp = 1;     // Ads, entries, ... handled by one op
+    };
+
+    Options g_options;
+    vector<Result> g_results;
+
+    bool selected(const string &name) {
+        return name.find(g_options.filter) != string::npos;
+    }
+
+    /** Run body over `iterations` items and record the mean cost per item.
+     *  itemsPerOp also reports the cost per ad, entry etc. */
+    void runBenchmark(const string &name, size_t iterations,
+                      const function<void(size_t)> &body,
+                      size_t itemsPerOp = 1) {
+        if (!selected(name)) {
+            return;
+        }
+        body(0);    // Warm up caches and lazy initialization
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            body(i);
+        }
+        double seconds = chrono::duration<double>(
+            chrono::steady_clock::now() - start).count();
+
+        Result result;
+        result.name = name;
+        result.iterations = iterations;
+        result.nanosecondsPerOp = seconds * 1e9 / iterations;
+        result.itemsPerOp = itemsPerOp;
+        g_results.push_back(result);
+        if (g_options.jsonOutput) {
+            return;
+        }
+        printf("%-44s %10zu iterations %14.1f ns/op", name.c_str(),
+               iterations, result.nanosecondsPerOp);
+        if (itemsPerOp > 1) {
+            printf(" %10.1f ns/item", result.nanosecondsPerOp / itemsPerOp);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    void printJSONResults() {
+        json benchmarks = json::array();
+        for (const Result &result : g_results) {
+            benchmarks.push_back({
+                {"name", result.name},
+                {"iterations", result.iterations},
+                {"ns_per_op", result.nanosecondsPerOp},
+                {"items_per_op", result.itemsPerOp},
+                {"ns_per_item", result.nanosecondsPerOp / result.itemsPerOp}
+            });
+        }
+        printf("%s\n", json{{"benchmarks", benchmarks}}.dump(2).c_str());
+    }
+
+    /** The parser used before Timestamp::parseISO8601, kept for comparison. */
+    time_t legacyZuluToTimestamp(const string &zuluDate) {
+        tm t{};
+        istringstream stringStream(zuluDate);
+
+        stringStream >> get_time(&t, "%Y-%m-%dT%H:%M:%S");
+        if (stringStream.fail()) {
+            throw runtime_error{"failed to parse time string"};
+        }
+
+        return mktime(&t);
+    }
+
+    /** The DOM parser used before the SAX handler of parseAds(), kept for
+     *  comparison. */
+    vector<Ad> legacyParseAds(const KufarConfiguration &configuration,
+                              const string &rawJson) {
+        vector<Ad> adverts;
+        json ads = json::parse(rawJson).at("ads");
+
+        for (const auto &ad : ads) {
+            Ad advert;
+
+            if (configuration.tag.has_value()) {
+                advert.tag = configuration.tag.value();
+            }
+
+            advert.title = ad.at("subject");
+            advert.id = ad.at("ad_id");
+            advert.date = zuluToTimestamp((string)ad.at("list_time"));
+            advert.price = stoi((string)ad.at("price_byn"));
+            advert.phoneNumberIsVisible = !ad.at("phone_hidden");
+            advert.link = ad.at("ad_link");
+
+            json accountParameters = ad.at("account_parameters");
+            for (const auto &accountParameter : accountParameters) {
+                if (accountParameter.at("p") == "name") {
+                    advert.sellerName = accountParameter.at("v");
+                    break;
+                }
+            }
+
+            if (ad.contains("ad_parameters")) {
+                json adParams = ad.at("ad_parameters");
+                for (const auto &param : adParams) {
+                    try {
+                        if (param.at("p") == "region") {
+                            advert.region =
+                                static_cast<Region>(param.at("v").get<int>());
+                        } else if (param.at("p") == "area") {
+                            if (param.at("v").is_number_integer()) {
+                                advert.area = param.at("v").get<int>();
+                            } else if (param.at("v").is_string()) {
+                                advert.area = stoi(param.at("v").get<string>());
+                            }
+                        }
+                    } catch (...) {
+                        // ignore parsing errors for optional fields
+                    }
+                }
+            }
+
+            json imagesArray = ad.at("images");
+            for (const auto &image : imagesArray) {
+                string imageID = image.at("id");
+                string path = image.at("path");
+                if (image.at("yams_storage")) {
+                    advert.images.push_back(
+                        "https://yams.kufar.by/api/v1/kufar-ads/images/" +
+                        imageID.substr(0, 2) + "/" + imageID +
+                        ".jpg?rule=pictures");
+                } else {
+                    advert.images.push_back("https://rms.kufar.by/v1/gallery/" + path);
+                }
+            }
+            adverts.push_back(advert);
+        }
+        return adverts;
+    }
+
+    vector<string> makeListTimes(size_t count) {
+        mt19937 random(42);
+        uniform_int_distribution<int64_t> seconds(1500000000, 1900000000);
+        vector<string> listTimes;
+        listTimes.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            time_t t = static_cast<time_t>(seconds(random));
+            tm parts{};
+            gmtime_r(&t, &parts);
+            char buffer[32];
+            strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", &parts);
+            listTimes.push_back(buffer);
+        }
+        return listTimes;
+    }
+
+    /** count distinct ads with random ids and prices. */
+    vector<AdPrice> makeEntries(size_t count) {
+        mt19937 random(7);
+        uniform_int_distribution<int> ids(1, INT_MAX);
+        uniform_int_distribution<int> prices(0, 100000000);
+        SeenAdStore unique;
+        unique.reserve(count);
+        vector<AdPrice> entries;
+        entries.reserve(count);
+        while (entries.size() < count) {
+            AdPrice entry{ids(random), prices(random)};
+            if (unique.upsert(entry.id, entry.price)) {
+                entries.push_back(entry);
+            }
+        }
+        return entries;
+    }
+
+    /** Half of the probes are ids from entries, half are random. */
+    vector<int> makeProbes(const vector<AdPrice> &entries, size_t count) {
+        mt19937 random(11);
+        uniform_int_distribution<size_t> index(0, entries.size() - 1);
+        uniform_int_distribution<int> ids(1, INT_MAX);
+        vector<int> probes;
+        probes.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            probes.push_back(i % 2 ? entries[index(random)].id : ids(random));
+        }
+        return probes;
+    }
+
+    vector<string> listFixtures(const string &directory) {
+        vector<string> names;
+        DIR *dir = opendir(directory.c_str());
+        if (dir == nullptr) {
+            return names;
+        }
+        while (dirent *entry = readdir(dir)) {
+            string name = entry->d_name;
+            if (name.size() > 5 && name.compare(name.size() - 5, 5, ".json") == 0) {
+                names.push_back(name);
+            }
+        }
+        closedir(dir);
+        sort(names.begin(), names.end());
+        return names;
+    }
+
+    void removeDirectory(const string &directory) {
+        if (DIR *dir = opendir(directory.c_str())) {
+            while (dirent *entry = readdir(dir)) {
+                string name = entry->d_name;
+                if (name != "." && name != "..") {
+                    unlink((directory + "/" + name).c_str());
+                }
+            }
+            closedir(dir);
+        }
+        rmdir(directory.c_str());
+    }
+
+    int benchTimestamps() {
+        const size_t COUNT = 1 << 16;
+        const size_t ITERATIONS = 1000000;
+        vector<string> listTimes = makeListTimes(COUNT);
+
+        // Under TZ=UTC mktime agrees with a correct UTC parser.
+        for (const string &listTime : listTimes) {
+            if (legacyZuluToTimestamp(listTime) != zuluToTimestamp(listTime)) {
+                fprintf(stderr, "timestamp mismatch for %s\n", listTime.c_str());
+                return 1;
+            }
+        }
+
+        runBenchmark("timestamp/legacy-get_time-mktime", ITERATIONS,
+            [&](size_t i) {
+                g_sink += legacyZuluToTimestamp(listTimes[i % COUNT]) + 3 * 3600;
+            });
+        runBenchmark("timestamp/parseISO8601", ITERATIONS,
+            [&](size_t i) {
+                g_sink += zuluToTimestamp(listTimes[i % COUNT]);
+            });
+        runBenchmark("timestamp/format", ITERATIONS / 4,
+            [&](size_t i) {
+                g_sink += static_cast<int64_t>(
+                    Timestamp::format(static_cast<time_t>(i) * 7919, 180).size());
+            });
+        return 0;
+    }
+
+    int benchParsing() {
+        vector<string> fixtures = listFixtures(g_options.fixtureDirectory);
+        if (fixtures.empty()) {
+            fprintf(stderr, "no *.json fixtures in %s\n",
+                    g_options.fixtureDirectory.c_str());
+            return 1;
+        }
+
+        KufarConfiguration configuration;
+        configuration.tag = "bench";
+        for (const string &fixture : fixtures) {
+            string body = getTextFromFile(g_options.fixtureDirectory + "/" + fixture);
+            string name = fixture.substr(0, fixture.size() - 5);
+
+            vector<Ad> streamed = parseAds(configuration, body);
+            vector<Ad> legacy = legacyParseAds(configuration, body);
+            bool same = streamed.size() == legacy.size();
+            for (size_t i = 0; same && i < streamed.size(); i++) {
+                same = streamed[i].id == legacy[i].id &&
+                       streamed[i].price == legacy[i].price &&
+                       streamed[i].date == legacy[i].date &&
+                       streamed[i].images == legacy[i].images;
+            }
+            if (!same || streamed.empty()) {
+                fprintf(stderr, "parsers disagree on %s\n", fixture.c_str());
+                return 1;
+            }
+
+            // About 50 MB of input per benchmark.
+            size_t iterations = max<size_t>(20, 50000000 / body.size());
+            runBenchmark("parse/" + name + "/legacy-dom", iterations,
+                [&](size_t) {
+                    g_sink += legacyParseAds(configuration, body).size();
+                }, streamed.size());
+            runBenchmark("parse/" + name + "/sax", iterations,
+                [&](size_t) {
+                    g_sink += parseAds(configuration, body).size();
+                }, streamed.size());
+
+            // A poll that only finds a few new ads on top of the watermark.
+            vector<time_t> dates;
+            for (const Ad &advert : streamed) {
+                dates.push_back(advert.date);
+            }
+            sort(dates.rbegin(), dates.rend());
+            ParseOptions options;
+            options.stopBefore = dates[min<size_t>(5, dates.size() - 1)];
+            runBenchmark("parse/" + name + "/sax-stop-at-watermark", iterations,
+                [&](size_t) {
+                    g_sink += parseAds(configuration, body, &options).size();
+                }, streamed.size());
+        }
+        return 0;
+    }
+
+    int benchURLs() {
+        KufarConfiguration configuration;
+        configuration.tag = "iphone 13 pro max";
+        configuration.onlyTitleSearch = true;
+        configuration.priceRange.priceMin = 50000;
+        configuration.priceRange.priceMax = 250000;
+        configuration.language = "ru";
+        configuration.limit = 200;
+        configuration.currency = "BYR";
+        configuration.condition = ItemCondition::used;
+        configuration.kufarDeliveryRequired = true;
+        configuration.onlyWithPhotos = true;
+        configuration.category = phonesAndTablets;
+        configuration.subCategory = 17010;
+        configuration.region = Region::Minsk;
+        configuration.areas = vector<int>{22, 23, 24, 30};
+
+        runBenchmark("url/getSearchURL", 1000000,
+            [&](size_t) {
+                g_sink += getSearchURL(configuration).size();
+            });
+        return 0;
+    }
+
+    int benchTelegram() {
+        vector<string> images;
+        for (int i = 0; i < 10; i++) {
+            images.push_back("https://yams.kufar.by/api/v1/kufar-ads/images/12/" +
+                             to_string(1234567890 + i) + ".jpg?rule=pictures");
+        }
+        const string caption = "iPhone 13 128GB\n1 200 р.\nМинск, Центральный\n"
+                               "https://www.kufar.by/item/230000000";
+
+        runBenchmark("telegram/makeImageGroupJSON", 200000,
+            [&](size_t) {
+                g_sink += Telegram::makeImageGroupJSON(images, caption).size();
+            });
+        runBenchmark("telegram/makeImageGroupJSON+dump", 200000,
+            [&](size_t) {
+                g_sink += Telegram::makeImageGroupJSON(images, caption).dump().size();
+            });
+        return 0;
+    }
+
+    int benchCacheLookups() {
+        const size_t PROBES = 4096;
+        for (size_t count : {1000, 10000, 100000, 1000000}) {
+            if (!selected("cache-lookup/getPriceFromCache/" + to_string(count)) &&
+                !selected("cache-lookup/SeenAdStore/" + to_string(count))) {
+                continue;
+            }
+            vector<AdPrice> entries = makeEntries(count);
+            vector<int> probes = makeProbes(entries, PROBES);
+            SeenAdStore store(entries);
+
+            for (int probe : probes) {
+                if (count <= 10000 &&
+                    getPriceFromCache(entries, probe) != store.find(probe)) {
+                    fprintf(stderr, "cache lookups disagree on %d\n", probe);
+                    return 1;
+                }
+            }
+
+            // The linear scan is only measured where it finishes in seconds.
+            if (count <= 100000) {
+                runBenchmark("cache-lookup/getPriceFromCache/" + to_string(count),
+                    max<size_t>(100, 200000000 / count),
+                    [&](size_t i) {
+                        g_sink += getPriceFromCache(entries, probes[i % PROBES])
+                                      .value_or(-1);
+                    });
+            }
+            runBenchmark("cache-lookup/SeenAdStore/" + to_string(count), 4000000,
+                [&](size_t i) {
+                    g_sink += store.find(probes[i % PROBES]).value_or(-1);
+                });
+        }
+        return 0;
+    }
+
+    int benchCacheFiles() {
+        char pattern[] = "/tmp/ads-scanner-bench.XXXXXX";
+        if (mkdtemp(pattern) == nullptr) {
+            perror("mkdtemp");
+            return 1;
+        }
+        const string directory = pattern;
+
+        for (size_t count : {10000, 100000, 1000000}) {
+            vector<AdPrice> entries;
+            vector<int> probes;
+            size_t iterations = max<size_t>(3, 1000000 / count);
+
+            for (const string format : {"json", "binary"}) {
+                const string path = directory + "/cache-" + format + "-" +
+                                    to_string(count) + ".json";
+                const string suffix = format + "/" + to_string(count);
+                if (!selected("cache-file/save/" + suffix) &&
+                    !selected("cache-file/load/" + suffix) &&
+                    !selected("cache-file/lookup/" + suffix)) {
+                    continue;
+                }
+                if (entries.empty()) {
+                    entries = makeEntries(count);
+                    probes = makeProbes(entries, 4096);
+                }
+                {
+                    CacheJournal journal(path);
+                    SeenAdStore store;
+                    journal.load(store);
+                    for (const AdPrice &entry : entries) {
+                        store.upsert(entry.id, entry.price);
+                    }
+                    // Leaves a complete snapshot even if save is filtered out.
+                    if (format == "binary") {
+                        journal.convertToBinary(store);
+                    } else {
+                        journal.compact(store);
+                    }
+                    runBenchmark("cache-file/save/" + suffix, iterations,
+                        [&](size_t) { journal.compact(store); }, count);
+                }
+                runBenchmark("cache-file/load/" + suffix, iterations,
+                    [&](size_t) {
+                        CacheJournal journal(path);
+                        SeenAdStore store;
+                        journal.load(store);
+                        g_sink += store.size();
+                    }, count);
+
+                CacheJournal journal(path);
+                SeenAdStore store;
+                journal.load(store);
+                if (store.size() != count) {
+                    fprintf(stderr, "%s cache lost entries\n", format.c_str());
+                    removeDirectory(directory);
+                    return 1;
+                }
+                runBenchmark("cache-file/lookup/" + suffix, 4000000,
+                    [&](size_t i) {
+                        g_sink += store.find(probes[i % probes.size()]).value_or(-1);
+                    });
+            }
+        }
+        removeDirectory(directory);
+        return 0;
+    }
+
+    const string prefixFilter = "--filter=";
+    const string prefixFormat = "--format=";
+    const string prefixFixtures = "--fixtures=";
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        if (stringHasPrefix(argument, prefixFilter)) {
+            g_options.filter = argument.substr(prefixFilter.size());
+        } else if (stringHasPrefix(argument, prefixFormat)) {
+            string format = argument.substr(prefixFormat.size());
+            if (format != "json" && format != "text") {
+                fprintf(stderr, "unknown format: %s\n", format.c_str());
+                return 2;
+            }
+            g_options.jsonOutput = (format == "json");
+        } else if (stringHasPrefix(argument, prefixFixtures)) {
+            g_options.fixtureDirectory = argument.substr(prefixFixtures.size());
+        } else {
+            fprintf(stderr, "usage: %s [--filter=<substring>] "
+                            "[--format=text|json] [--fixtures=<dir>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+    const vector<function<int()>> suites = {
+        benchTimestamps, benchParsing, benchURLs, benchTelegram,
+        benchCacheLookups, benchCacheFiles
+    };
+    for (const auto &suite : suites) {
+        if (int status = suite()) {
+            return status;
+        }
+    }
+    if (g_options.jsonOutput) {
+        printJSONResults();
+    }
+    return 0;
+}
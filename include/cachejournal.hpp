@@ -0,0 +1,78 @@
+#ifndef cachejournal_hpp
+#define cachejournal_hpp
+
+#include <string>
+#include <cstdint>
+#include "seenadstore.hpp"
+
+/** Write-ahead journal for the seen-ad cache.
+ *
+ *  The snapshot is either the legacy JSON array or the memory-mapped binary
+ *  format of MappedCache; the format is detected from the file contents and
+ *  kept on compaction.
+ *
+ *  Every new ad or price change is appended to "<snapshot>.journal" as a
+ *  fixed-size checksummed record instead of rewriting the whole snapshot.
+ *  Records are written immediately and fsync'ed in batches. compact()
+ *  atomically replaces the snapshot with the current store and empties the
+ *  journal. On startup load() reads the snapshot and applies the journal on
+ *  top of it; a torn record at the tail is discarded. */
+class CacheJournal {
+public:
+    enum class Format { json, binary };
+
+    explicit CacheJournal(const std::string &snapshotPath);
+    ~CacheJournal();
+
+    CacheJournal(const CacheJournal &) = delete;
+    CacheJournal &operator=(const CacheJournal &) = delete;
+
+    /** Load the snapshot into store (creating an empty JSON snapshot if
+     *  there is none), replay the journal and open it for appending.
+     *  Returns the number of records replayed. Throws on I/O errors. */
+    size_t load(SeenAdStore &store);
+
+    /** Append one record; fsync happens every SYNC_BATCH records or on sync(). */
+    void append(int id, int price);
+
+    /** Flush outstanding records to stable storage. */
+    void sync();
+
+    /** True once the journal has grown larger than a fresh JSON snapshot
+     *  would be, or, over a binary snapshot, once it holds
+     *  MAX_BINARY_JOURNAL_RECORDS records; the in-memory overlay never has
+     *  more entries than the journal has records. */
+    bool needsCompaction(const SeenAdStore &store) const;
+
+    /** Write store as the new snapshot and truncate the journal. A binary
+     *  snapshot is remapped and store rebased onto it. */
+    void compact(SeenAdStore &store);
+
+    /** Switch the snapshot to the binary format. The previous JSON snapshot
+     *  is kept as "<snapshot>.bak". */
+    void convertToBinary(SeenAdStore &store);
+
+    Format format() const { return snapshotFormat; }
+    size_t recordCount() const { return records; }
+    const std::string &path() const { return journalPath; }
+
+private:
+    static constexpr size_t SYNC_BATCH = 64;
+    static constexpr size_t MIN_COMPACTION_RECORDS = 1000;
+    // Rewriting a binary snapshot is a sequential write of 8 bytes per ad,
+    // so keep the overlay small rather than proportional to the cache.
+    static constexpr size_t MAX_BINARY_JOURNAL_RECORDS = 65536;
+
+    void loadSnapshot(SeenAdStore &store);
+    size_t replay(SeenAdStore &store);
+    void openForAppend();
+
+    Format snapshotFormat = Format::json;
+    std::string snapshotPath;
+    std::string journalPath;
+    int fd = -1;
+    size_t records = 0;
+    size_t unsyncedRecords = 0;
+};
+
+#endif /* cachejournal_hpp */
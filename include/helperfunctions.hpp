@@ -66,11 +66,13 @@ void cleanupCacheByIds(
 bool fileExists(const std::string &);
 uint64_t getFileSize(const std::string &);
 std::string getTextFromFile(const std::string &);
+/** Seconds since the epoch of an ISO-8601 UTC time. Throws on bad input. */
 time_t zuluToTimestamp(const std::string &);
 std::string joinIntVector(const std::vector<int> &, const std::string &);
-time_t timestampShift(const time_t &, int);
 bool stringHasPrefix(const std::string &, const std::string &);
 void saveFile(const std::string &path, const std::string &contents);
+/** Write to "<path>.tmp", fsync it and rename it over path. Throws on error. */
+void saveFileAtomically(const std::string &path, const std::string &contents);
 std::optional<std::string> getWorkingDirectory();
 
 #endif
@@ -1,7 +1,9 @@
 #ifndef kufar_hpp
 #define kufar_hpp
 
+#include <string>
 #include <vector>
+#include <cstdint>
 #include <optional>
 
 
@@ -484,6 +486,11 @@ namespace Kufar {
         
     };
 
+	enum class ItemCondition {
+        used = 1,
+        _new = 2
+    };
+
     struct Ad {
         std::optional<std::string> tag;
         std::string title;
@@ -496,6 +503,8 @@ namespace Kufar {
         std::vector<std::string> images;
         std::optional<Region> region;
         std::optional<int> area;
+        std::optional<ItemCondition> condition;
+        bool companyAd;
     };
 
     struct PriceRange {
@@ -505,11 +514,6 @@ namespace Kufar {
         std::optional<std::string> joinPrice() const;
     };
 
-	enum class ItemCondition {
-        used = 1,
-        _new = 2
-    };
-
     enum class SellerType {
         individualPerson = 0,
         company = 1
@@ -540,8 +544,107 @@ namespace Kufar {
         std::optional<int> subCategory;                 // Default: [undefined]
         std::optional<Region> region;                   // Default: [undefined]
         std::optional<std::vector<int>> areas;          // Default: [undefined]
+
+        // Polling schedule, not sent to Kufar.
+        std::optional<int> intervalSeconds;             // Default: delays.loop
+        std::optional<int> jitterSeconds;               // Default: 0
+        std::optional<int> maxPages;                    // Default: pagination.max-pages
+    };
+
+    struct PageToken {
+        int number = 0;
+        std::string token;      // Value of the "cursor" URL parameter
+    };
+
+    /** Cursor tokens from the "pagination" object of a search response. */
+    struct Pagination {
+        std::optional<std::string> next;    // Token of the following page
+        std::vector<PageToken> pages;       // Pages listed for direct access
+    };
+
+    /** Optional inputs and outputs of parseAds(). */
+    struct ParseOptions {
+        Pagination *pagination = nullptr;   // Receives the page tokens
+        // Search results come newest first unless a price sort is set. Once
+        // STOP_AFTER_OLD_ADS consecutive ads were listed before this time,
+        // the rest of the response is older still and is not parsed.
+        std::optional<time_t> stopBefore;
+        bool stoppedEarly = false;          // Set when stopBefore was hit
+    };
+
+    /** Consecutive old ads that end a newest-first response. More than one,
+     *  so a promoted ad pinned to the top cannot end it. */
+    constexpr int STOP_AFTER_OLD_ADS = 3;
+
+    /** Filters of one configuration that its plan's request does not
+     *  apply upstream and that are evaluated on the parsed ads instead. They
+     *  mirror the server's semantics: prices are compared in price_byn
+     *  units, and an ad without the region or area parameter fails a
+     *  region or area filter. */
+    struct LocalFilter {
+        std::optional<int> priceMin;        // price_byn, inclusive
+        std::optional<int> priceMax;
+        std::optional<Region> region;
+        std::optional<std::vector<int>> areas;
+        std::optional<ItemCondition> condition;
+        bool companyOnly = false;
+        bool photosOnly = false;
+
+        bool empty() const;
+        bool matches(const Ad &) const;
+    };
+
+    /** A configuration served by a plan. */
+    struct PlanMember {
+        size_t configuration = 0;
+        LocalFilter filter;                 // Empty unless coalesced
+    };
+
+    /** A KufarConfiguration compiled once at load time into everything the
+     *  poll loop needs, so polling builds no strings. Configurations that
+     *  produce the same request share one plan.
+     *
+     *  With coalescing, newest-first configurations that differ only in
+     *  filters which can be checked on a parsed Ad (price, region and
+     *  areas, condition, seller type, photos, page size) share one broader
+     *  request too. Each member then keeps its own LocalFilter, and an ad
+     *  is processed when it matches any member. */
+    struct QueryPlan {
+        std::string url;                    // Canonical key of the query
+        uint64_t hash = 0;                  // FNV-1a of url
+        std::string label;                  // Tag, or "(no tag)", for logs
+        size_t configuration = 0;           // Index of the first configuration
+        std::vector<PlanMember> members;    // Every configuration, first included
+        int intervalSeconds = 0;            // Shortest of the merged intervals
+        int jitterSeconds = 0;
+        int maxPages = 1;                   // Deepest page one poll may read
+
+        /** True when some member filters ads locally. */
+        bool filtersLocally() const;
+        /** True when the ad matches at least one member. */
+        bool matches(const Ad &) const;
     };
 
+    std::string getSearchURL(const KufarConfiguration &);
+    /** Compile every configuration, merging identical requests, and with
+     *  coalesce also compatible ones. Queries without an interval use
+     *  defaultIntervalSeconds. Plans that filter locally read at least
+     *  coalescedMaxPages pages. */
+    std::vector<QueryPlan> compileQueryPlans(
+        const std::vector<KufarConfiguration> &,
+        int defaultIntervalSeconds,
+        int defaultMaxPages = 1,
+        bool coalesce = false,
+        int coalescedMaxPages = 1);
+    /** URL of a later page of plan, addressed by a pagination token. */
+    std::string getPageURL(const QueryPlan &, const std::string &token);
+    /** True when the configuration's results are ordered newest first. */
+    bool isSortedByListTime(const KufarConfiguration &);
+    /** Extract the adverts of a search response, see ParseOptions. Throws
+     *  on malformed input. */
+    std::vector<Ad> parseAds(const KufarConfiguration &,
+                             const std::string &rawJson,
+                             ParseOptions *options = nullptr);
     std::vector<Ad> getAds(const KufarConfiguration &);
 
     namespace EnumString {
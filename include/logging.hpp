@@ -1,21 +1,61 @@
-#ifndef logging_hpp
-#define logging_hpp
-
-#include <string>
-
-namespace Log {
-
-/** Initialize logging to the given file path. Must be called before info/warn/error.
- *  Returns false if the file could not be opened (caller may exit). */
-bool init(const std::string &filePath);
-
-void info(const std::string &msg);
-void warn(const std::string &msg);
-void error(const std::string &msg);
-
-/** Returns true if init() was successfully called. */
-bool isInitialized();
-
-} // namespace Log
-
-#endif /* logging_hpp */
+#ifndef logging_hpp
+#define logging_hpp
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+/** Asynchronous file logger.
+ *
+ *  info/warn/error only stamp the message with its level and time and put
+ *  it on a lock-free ring buffer; a background thread formats the records
+ *  and writes them in batches every 100 ms, or sooner once the
+ *  buffer is half full, flushing once per batch. A full buffer drops
+ *  the record instead of blocking the caller, and the writer reports how
+ *  many were lost. Records below the level set with setLevel() are
+ *  rejected before anything is queued; the LOG_* macros also skip building
+ *  the message. */
+namespace Log {
+
+enum class Level { debug = 0, info = 1, warn = 2, error = 3 };
+
+struct Stats {
+    uint64_t written = 0;   // Records written to the file
+    uint64_t dropped = 0;   // Records lost to a full buffer
+};
+
+namespace detail {
+    extern std::atomic<int> minimumLevel;
+}
+
+/** Initialize logging to the given file path and start the writer. Must be
+ *  called before info/warn/error. Returns false if the file could not be
+ *  opened (caller may exit). */
+bool init(const std::string &filePath);
+
+/** Write out everything queued and stop the writer. Also runs at exit. */
+void shutdown();
+
+void setLevel(Level level);
+
+inline bool enabled(Level level) {
+    return static_cast<int>(level) >=
+           detail::minimumLevel.load(std::memory_order_relaxed);
+}
+
+void debug(std::string msg);
+void info(std::string msg);
+void warn(std::string msg);
+void error(std::string msg);
+
+/** Returns true if init() was successfully called. */
+bool isInitialized();
+
+Stats stats();
+
+} // namespace Log
+
+#define LOG_DEBUG(msg) do { if (Log::enabled(Log::Level::debug)) Log::debug(msg); } while (false)
+#define LOG_INFO(msg) do { if (Log::enabled(Log::Level::info)) Log::info(msg); } while (false)
+
+#endif /* logging_hpp */
@@ -0,0 +1,55 @@
+#ifndef mappedcache_hpp
+#define mappedcache_hpp
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include "helperfunctions.hpp"
+
+/** Read-only view of a binary seen-ad cache file.
+ *
+ *  File layout (native byte order):
+ *    32-byte header: "ADSCACHE", version, entry size, entry count,
+ *                    reserved flags, FNV-1a checksum of the header
+ *    count x AdPrice {int32 id; int32 price}, sorted by id
+ *
+ *  The file is mmap'ed and searched in place, so opening it costs the same
+ *  for ten entries or ten million and pages are only faulted in on lookup. */
+class MappedCache {
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    MappedCache() = default;
+    ~MappedCache();
+
+    MappedCache(const MappedCache &) = delete;
+    MappedCache &operator=(const MappedCache &) = delete;
+
+    /** Map the file at path. Throws if it cannot be mapped, is truncated or
+     *  fails the header check. */
+    void open(const std::string &path);
+
+    /** True if the file at path starts with the binary cache magic. */
+    static bool isBinaryCache(const std::string &path);
+
+    /** Sort entries by id (last duplicate wins) and atomically write them
+     *  to path in the binary format. */
+    static void write(const std::string &path, std::vector<AdPrice> entries);
+
+    std::optional<int> find(int id) const;
+
+    size_t size() const { return count; }
+    const AdPrice *begin() const { return items; }
+    const AdPrice *end() const { return items + count; }
+
+private:
+    void unmap();
+
+    void *mapping = nullptr;
+    size_t mappingLength = 0;
+    const AdPrice *items = nullptr;
+    size_t count = 0;
+};
+
+#endif /* mappedcache_hpp */
@@ -0,0 +1,137 @@
+#ifndef metrics_hpp
+#define metrics_hpp
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+/** In-process metrics in the Prometheus text exposition format.
+ *
+ *  counter(), gauge() and histogram() register a series on first use and
+ *  return the same object for the same name and labels afterwards; the
+ *  objects live until exit. Registration takes a mutex, updating a series
+ *  is a relaxed atomic, so hot paths look a series up once and keep the
+ *  reference. */
+namespace Metrics {
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+
+    class Counter {
+    public:
+        void add(uint64_t amount = 1) {
+            value.fetch_add(amount, std::memory_order_relaxed);
+        }
+        uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> value{0};
+    };
+
+    class Gauge {
+    public:
+        void set(double newValue) {
+            value.store(newValue, std::memory_order_relaxed);
+        }
+        double get() const { return value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<double> value{0};
+    };
+
+    /** Log-linear (HDR-style) histogram of non-negative integers. Every
+     *  power of two is split into SUB_BUCKETS buckets, so any recorded value
+     *  is reproduced within 1/SUB_BUCKETS of itself over the full 64-bit
+     *  range, without configuring bucket bounds up front. */
+    class Histogram {
+    public:
+        static constexpr int SUB_BUCKET_BITS = 4;
+        static constexpr uint64_t SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+        static constexpr size_t BUCKETS =
+            2 * SUB_BUCKETS + (64 - SUB_BUCKET_BITS - 1) * SUB_BUCKETS;
+
+        struct Snapshot {
+            uint64_t count = 0;
+            uint64_t sum = 0;
+            std::vector<uint64_t> buckets;
+
+            /** Values recorded at or below value. Buckets that straddle
+             *  value are left out, so this undercounts by at most the
+             *  values within 1/SUB_BUCKETS below it. */
+            uint64_t countAtOrBelow(uint64_t value) const;
+        };
+
+        void record(uint64_t value);
+        void record(std::chrono::steady_clock::duration elapsed) {
+            record(static_cast<uint64_t>(std::chrono::duration_cast<
+                std::chrono::microseconds>(elapsed).count()));
+        }
+        Snapshot snapshot() const;
+
+        static size_t bucketOf(uint64_t value);
+        static uint64_t highestValueIn(size_t bucket);
+
+    private:
+        std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+        std::atomic<uint64_t> sum{0};
+    };
+
+    Counter &counter(const std::string &name, const std::string &help,
+                     const Labels &labels = {});
+    Gauge &gauge(const std::string &name, const std::string &help,
+                 const Labels &labels = {});
+
+    /** Upper bounds, in exported units, for request and processing times. */
+    const std::vector<double> &durationBuckets();
+
+    /** unit converts recorded integers to the exported value, e.g. 1e-6
+     *  for durations recorded in microseconds and exported in seconds.
+     *  Exported as a Prometheus histogram with cumulative _bucket series at
+     *  buckets (in exported units, ascending), _sum and _count; the first
+     *  registration of a name fixes unit and buckets. */
+    Histogram &histogram(const std::string &name, const std::string &help,
+                         double unit = 1, const Labels &labels = {},
+                         const std::vector<double> &buckets = durationBuckets());
+
+    /** Every registered series in the Prometheus text format 0.0.4. */
+    std::string render();
+
+    struct ExporterOptions {
+        // Serve GET /metrics on address:port; 0 disables the endpoint.
+        std::string address = "127.0.0.1";
+        int port = 0;
+        // Rewrite this file every interval; empty disables it.
+        std::string filePath;
+        std::chrono::seconds interval{15};
+    };
+
+    /** Serves render() over HTTP and/or writes it to a file from a
+     *  background thread. */
+    class Exporter {
+    public:
+        explicit Exporter(const ExporterOptions &options);
+        ~Exporter();
+
+        /** Bind the port and start the thread. Throws std::runtime_error
+         *  if the address cannot be bound. */
+        void start();
+
+        /** Write the file one last time and stop serving. */
+        void shutdown();
+
+    private:
+        void run();
+        void serve(int client);
+        void writeFile();
+
+        ExporterOptions options;
+        int listener = -1;
+        std::atomic<bool> stopping{false};
+        std::thread worker;
+    };
+};
+
+#endif /* metrics_hpp */
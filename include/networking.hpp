@@ -1,9 +1,95 @@
 #ifndef networking_hpp
 #define networking_hpp
 
+#include <map>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <functional>
+
 namespace Networking {
+    /** Per-host counters of the keep-alive connection pool. */
+    struct PoolStats {
+        uint64_t requests = 0;          // Transfers performed
+        uint64_t handleReuses = 0;      // Easy handle taken from the idle pool
+        uint64_t newHandles = 0;        // Easy handle created from scratch
+        uint64_t newConnections = 0;    // Transfers that opened a new socket
+        double handshakeSeconds = 0;    // TCP + TLS time of new connections
+        uint64_t wireBytes = 0;         // Headers + body as received
+        uint64_t decodedBytes = 0;      // Body after gzip/br decoding
+        uint64_t notModified = 0;       // 304 responses
+    };
+
+    /** Status and headers of a response. Names are lower-cased; a header
+     *  that repeats keeps its last value. */
+    struct ResponseHeaders {
+        long status = 0;
+        std::map<std::string, std::string> fields;
+
+        std::optional<std::string> get(const std::string &lowerCaseName) const;
+    };
+
+    /** One GET issued by fetchAll(), with optional cache validators. */
+    struct FetchRequest {
+        std::string url;
+        std::string etag;           // Sent as If-None-Match when not empty
+        std::string lastModified;   // Sent as If-Modified-Since when not empty
+    };
+
+    /** Outcome of one transfer issued by fetchAll(). ok is set for 2xx and
+     *  304 responses; a 304 has notModified set and an empty body. */
+    struct FetchResult {
+        size_t index = 0;       // Position of the request in the list
+        bool ok = false;
+        bool notModified = false;
+        std::string body;
+        uint64_t bodyHash = 0;  // XXH64 of body, computed while receiving it
+        uint64_t wireBytes = 0; // Headers + body as received
+        ResponseHeaders headers;
+        std::string error;
+    };
+
+    /** Counters of fetchAll()'s single-flight layer. */
+    struct SingleFlightStats {
+        uint64_t transfers = 0;     // Requests that went to the network
+        uint64_t joined = 0;        // Shared the transfer of an identical request
+        uint64_t reused = 0;        // Served from a recent identical result
+    };
+
+    using FetchCallback = std::function<void(FetchResult &)>;
+
     std::string urlEncode(const std::string &);
     std::string getJSONFromURL(const std::string &);
+
+    /** POST body with Content-Type: application/json and return the
+     *  response body, or "" on transport failure. */
+    std::string postJSON(const std::string &url, const std::string &body);
+
+    /** Fetch all requests concurrently over curl_multi, keeping at most
+     *  maxInFlight transfers running. onComplete is called on the calling
+     *  thread for every request, in completion order, as soon as its
+     *  transfer finishes. Bodies are requested gzip or br compressed and
+     *  decoded transparently.
+     *
+     *  Requests are single-flight, keyed by URL and validators: identical
+     *  requests in one call share one transfer, and a successful result is
+     *  handed out again, without a transfer, to identical requests made
+     *  within the reuse window. */
+    void fetchAll(const std::vector<FetchRequest> &requests,
+                  size_t maxInFlight,
+                  const FetchCallback &onComplete);
+
+    /** How long a result may answer identical requests; 0 disables it. */
+    void setReuseWindow(std::chrono::milliseconds);
+    SingleFlightStats getSingleFlightStats();
+
+    /** Snapshot of pool statistics keyed by host. */
+    std::map<std::string, PoolStats> getPoolStats();
+
+    /** Close all pooled connections. Call before curl_global_cleanup(). */
+    void cleanupConnectionPool();
 };
 
 #endif /* networking_hpp */
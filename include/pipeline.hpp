@@ -0,0 +1,258 @@
+#ifndef pipeline_hpp
+#define pipeline_hpp
+
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <functional>
+#include <unordered_map>
+
+#include "kufar.hpp"
+#include "telegram.hpp"
+#include "scheduler.hpp"
+#include "ringbuffer.hpp"
+#include "tenant.hpp"
+#include "watermarkstore.hpp"
+#include "metrics.hpp"
+
+/** Snapshot of one pipeline stage. Counters are cumulative. */
+struct StageStats {
+    std::string name;
+    unsigned threads = 0;
+    uint64_t processed = 0;     // Items the stage finished
+    uint64_t failed = 0;
+    uint64_t skipped = 0;       // Unchanged bodies passed over, or pages
+                                // cut short at the watermark
+    uint64_t shared = 0;        // Results taken from an identical item
+    size_t queueDepth = 0;      // Items waiting in front of the stage
+    size_t peakQueueDepth = 0;
+    size_t queueCapacity = 0;
+    double busySeconds = 0;     // Summed over the stage's threads
+};
+
+struct PipelineOptions {
+    unsigned parseThreads = 2;
+    size_t queueDepth = 64;     // Capacity of the parse and diff queues
+    // Crawl every page up to backfillMaxPages and record the ads without
+    // notifying anybody.
+    bool backfill = false;
+    int backfillMaxPages = 100;
+    // How far behind its watermark a query is still parsed, for ads that
+    // were edited without moving up the list.
+    int watermarkSafetySeconds = 600;
+    // How long a parse result answers identical pages; see ScanPipeline.
+    std::chrono::milliseconds reuseWindow{2000};
+};
+
+/** The scan as four stages connected by bounded ring buffers:
+ *
+ *    fetch  --[pages]-->  parse x N  --[ads]-->  diff  --[adverts]-->  notify
+ *
+ *  fetch() runs on the caller's thread, since curl_multi belongs to it.
+ *  Parsing runs on a pool of parseThreads. Diffing runs on one thread,
+ *  because it owns the tenants' seen-ad stores and journals. Notification is the
+ *  Telegram Sender's own thread. A full queue blocks only the stage that
+ *  feeds it, so a slow stage delays its producers instead of the whole
+ *  scan.
+ *
+ *  A 304 to a conditional request, or a body whose hash equals the last
+ *  body of the same plan that was diffed without errors, cannot contain
+ *  anything new, so it is dropped right after the fetch and never parsed
+ *  or diffed. A first page that fails to parse or diff also drops the
+ *  plan's validators, so the next poll gets the full body again.
+ *
+ *  When the oldest ad of a page is new, newer ones may have pushed unseen
+ *  ads onto the next pages. The diff stage then queues the pages listed
+ *  in the response's pagination tokens, up to the plan's maxPages, and
+ *  the next fetch() requests them concurrently with the due plans.
+ *
+ *  With a WatermarkStore, the diff stage records the newest ad of every
+ *  plan, once every tenant has recorded the page without errors. Parsing a newest-first response then stops a safety window behind
+ *  that watermark, so a steady-state poll builds only the few Ad records
+ *  that can be new. Price drops of ads older than the window go unseen;
+ *  backfill ignores the watermarks but still advances them.
+ *
+ *  A plan may serve queries of several tenants. Its ads are diffed once
+ *  per tenant against that tenant's seen ads, after being narrowed to the
+ *  ads some member query of that tenant wants when the plan is coalesced.
+ *
+ *  Parsing is single-flight: a page whose body, tag and watermark cutoff
+ *  equal those of a page being parsed, or parsed within reuseWindow,
+ *  shares that page's immutable result instead of being parsed again. */
+class ScanPipeline {
+public:
+    /** tenantOfConfiguration maps every configuration to its index in
+     *  tenants. adaptivePolicy may be null when adaptive scheduling is off,
+     *  and watermarks when parsing should never stop early. */
+    ScanPipeline(const std::vector<Kufar::KufarConfiguration> &configurations,
+                 const std::vector<size_t> &tenantOfConfiguration,
+                 const std::vector<Kufar::QueryPlan> &queryPlans,
+                 std::vector<Tenant> &tenants,
+                 Telegram::Sender &sender,
+                 AdaptivePolicy *adaptivePolicy,
+                 WatermarkStore *watermarks,
+                 const PipelineOptions &options);
+    ~ScanPipeline();
+
+    ScanPipeline(const ScanPipeline &) = delete;
+    ScanPipeline &operator=(const ScanPipeline &) = delete;
+
+    void start();
+
+    /** Fetch the first page of the given plans, plus every queued
+     *  follow-up page, concurrently and hand each body to the parsers as
+     *  soon as it arrives. Returns when every transfer is done; parsing and
+     *  diffing continue in the background. */
+    void fetch(const std::vector<size_t> &plans, size_t maxInFlight);
+
+    /** True when follow-up pages are waiting for fetch(). */
+    bool hasFollowUps() const { return followUps.size() > 0; }
+
+    /** True when nothing is queued or being parsed or diffed. */
+    bool idle() const;
+
+    /** Let the parse and diff stages finish what is queued, join them,
+     *  compact the cache and save the watermarks. The Sender is left
+     *  running. */
+    void shutdown();
+
+    /** fetch, parse, diff and notify, in that order. */
+    std::vector<StageStats> stats() const;
+
+private:
+    struct FetchedPage {
+        size_t plan = 0;
+        int pageNumber = 1;
+        std::string body;
+        uint64_t bodyHash = 0;
+    };
+
+    struct ParseOutput {
+        std::vector<Kufar::Ad> ads;
+        Kufar::Pagination pagination;
+        bool stoppedEarly = false;
+    };
+
+    struct ParsedPage {
+        size_t plan = 0;
+        int pageNumber = 1;
+        uint64_t bodyHash = 0;
+        std::shared_ptr<const ParseOutput> output;
+    };
+
+    // A parse result, or the promise of one while finished is empty.
+    struct ParseCacheEntry {
+        std::shared_future<std::shared_ptr<const ParseOutput>> output;
+        std::optional<std::chrono::steady_clock::time_point> finished;
+    };
+
+    struct FollowUp {
+        size_t plan = 0;
+        int pageNumber = 0;
+        std::string token;
+    };
+
+    struct StageCounters {
+        std::atomic<uint64_t> processed{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> skipped{0};
+        std::atomic<uint64_t> shared{0};
+        std::atomic<uint64_t> busyMicroseconds{0};
+        std::atomic<size_t> peakQueueDepth{0};
+    };
+
+    void parseWorker();
+    /** parse()'s result, or that of an identical key; shared tells which. */
+    std::shared_ptr<const ParseOutput> parseShared(
+        const std::string &key, bool &shared,
+        const std::function<std::shared_ptr<const ParseOutput>()> &parse);
+    void diffWorker();
+    unsigned processAds(Tenant &tenant, const std::vector<Kufar::Ad> &ads);
+    void queueFollowUps(const ParsedPage &page, bool lastAdWasNew);
+    void compactCache(Tenant &tenant, bool force);
+    void advanceWatermark(const ParsedPage &page);
+    /** Make the next poll of plan parse and diff its first page again. */
+    void forgetFirstPage(size_t plan);
+    void saveWatermarks(bool force);
+
+    static void recordDepth(StageCounters &counters, size_t depth);
+    static void recordBusy(StageCounters &counters,
+                           std::chrono::steady_clock::time_point since);
+    static StageStats makeStats(const std::string &name, unsigned threads,
+                                const StageCounters &counters);
+
+    const std::vector<Kufar::KufarConfiguration> &configurations;
+    const std::vector<Kufar::QueryPlan> &queryPlans;
+    std::vector<Tenant> &tenants;
+    Telegram::Sender &sender;
+    AdaptivePolicy *adaptivePolicy;
+    WatermarkStore *watermarks;
+    const PipelineOptions options;
+
+    RingBuffer<FetchedPage> pages;
+    RingBuffer<ParsedPage> parsedPages;
+    RingBuffer<FollowUp> followUps;
+    // Pages pushed to the parsers and not yet diffed or dropped.
+    std::atomic<int64_t> outstandingPages{0};
+    std::vector<std::thread> parseThreads;
+    std::thread diffThread;
+    // HTTP validators from the last full response of a plan.
+    struct Validators {
+        std::string etag;
+        std::string lastModified;
+    };
+
+    // The members of a plan that belong to one tenant.
+    struct TenantShare {
+        size_t tenant = 0;
+        std::vector<size_t> members;    // Indices into QueryPlan::members
+        bool filtersLocally = false;
+    };
+    std::vector<std::vector<TenantShare>> tenantShares;  // Per plan
+
+    // Per plan, fetch thread only.
+    std::vector<Validators> validators;
+    // Per plan, written by the parse and diff stages and read by fetch:
+    // hash of the last first page diffed without errors (0 for none), and
+    // whether validators must be dropped before the next request.
+    std::unique_ptr<std::atomic<uint64_t>[]> handledBodyHash;
+    std::unique_ptr<std::atomic<bool>[]> dropValidators;
+    // Deepest page queued during the current poll of each plan; diff only.
+    std::vector<int> requestedPages;
+    // Newest list time of the last first page, and of the one before the
+    // current poll; diff only.
+    std::vector<time_t> newestListTime;
+    std::vector<time_t> pollBaseline;
+    // Per plan, written by diff and read by the parsers: list time before
+    // which parsing stops, or 0 for none.
+    std::unique_ptr<std::atomic<time_t>[]> stopBefore;
+    std::chrono::steady_clock::time_point lastWatermarkSave;
+    bool started = false;
+    bool stopped = false;
+
+    std::mutex parseCacheMutex;
+    std::unordered_map<std::string, ParseCacheEntry> parseCache;
+
+    // Registered once so the workers never take the registry lock.
+    struct PlanGauges {
+        Metrics::Gauge *lastPoll = nullptr;
+        Metrics::Gauge *newestAd = nullptr;
+    };
+    std::vector<PlanGauges> planGauges;
+    Metrics::Histogram &parseDuration;
+    Metrics::Counter &cacheHits;
+    Metrics::Counter &cacheMisses;
+
+    StageCounters fetchCounters;
+    StageCounters parseCounters;
+    StageCounters diffCounters;
+};
+
+#endif /* pipeline_hpp */
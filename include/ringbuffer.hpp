@@ -0,0 +1,222 @@
+#ifndef ringbuffer_hpp
+#define ringbuffer_hpp
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <algorithm>
+#include <condition_variable>
+
+/** Bounded lock-free multi-producer / multi-consumer FIFO.
+ *
+ *  Slots carry a sequence number (Vyukov's bounded MPMC queue), so tryPush()
+ *  and tryPop() are a CAS on a position counter and never take a lock; with
+ *  one producer and one consumer it behaves as an SPSC ring. Only a thread
+ *  that finds the ring full or empty parks on a condition variable, and
+ *  the other side touches that mutex only when somebody is parked.
+ *
+ *  push() blocks while the ring is full, which is how producers feel
+ *  backpressure from a slow consumer. After close() no new items are
+ *  accepted, but consumers keep receiving what is already queued until it
+ *  runs dry, so closing doubles as a drain signal. Close only after the
+ *  producers have stopped; an item pushed concurrently with close() may be
+ *  left behind. The capacity is rounded up to a power of two. */
+template<typename T>
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t capacity)
+        : mask(roundUpToPowerOfTwo(capacity) - 1), cells(mask + 1) {
+        for (size_t i = 0; i <= mask; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    RingBuffer(const RingBuffer &) = delete;
+    RingBuffer &operator=(const RingBuffer &) = delete;
+
+    /** Wait for free space and enqueue. Returns false if the ring is closed. */
+    bool push(T item) {
+        while (!isClosed()) {
+            if (enqueue(item)) {
+                wake(notEmpty, consumersWaiting);
+                return true;
+            }
+            park(notFull, producersWaiting, std::chrono::steady_clock::now() +
+                 MAX_PARK, [this] { return isClosed() || !full(); });
+        }
+        return false;
+    }
+
+    /** Enqueue without waiting. Returns false if full or closed. */
+    bool tryPush(T &item) {
+        if (isClosed() || !enqueue(item)) {
+            return false;
+        }
+        wake(notEmpty, consumersWaiting);
+        return true;
+    }
+
+    /** Wait for an item. Returns nullopt once the ring is closed and empty. */
+    std::optional<T> pop() {
+        while (true) {
+            if (std::optional<T> item = tryPop()) {
+                return item;
+            }
+            if (isClosed() && empty()) {
+                return std::nullopt;
+            }
+            park(notEmpty, consumersWaiting, std::chrono::steady_clock::now() +
+                 MAX_PARK, [this] { return isClosed() || !empty(); });
+        }
+    }
+
+    /** Like pop(), but gives up after timeout. */
+    template<typename Rep, typename Period>
+    std::optional<T> popFor(const std::chrono::duration<Rep, Period> &timeout) {
+        auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+        while (true) {
+            if (std::optional<T> item = tryPop()) {
+                return item;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if ((isClosed() && empty()) || now >= deadline) {
+                return std::nullopt;
+            }
+            park(notEmpty, consumersWaiting, std::min(deadline, now + MAX_PARK),
+                 [this] { return isClosed() || !empty(); });
+        }
+    }
+
+    /** Dequeue without waiting. */
+    std::optional<T> tryPop() {
+        std::optional<T> item = dequeue();
+        if (item.has_value()) {
+            wake(notFull, producersWaiting);
+        }
+        return item;
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_seq_cst);
+        std::lock_guard<std::mutex> lock(parkMutex);
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    /** Items queued; approximate while other threads are active. */
+    size_t size() const {
+        size_t tail = dequeuePosition.load(std::memory_order_acquire);
+        size_t head = enqueuePosition.load(std::memory_order_acquire);
+        return head > tail ? head - tail : 0;
+    }
+
+    bool isClosed() const { return closed.load(std::memory_order_acquire); }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    // Upper bound on one wait, in case a wakeup is ever missed.
+    static constexpr std::chrono::milliseconds MAX_PARK{100};
+
+    struct Cell {
+        std::atomic<size_t> sequence{0};
+        T value{};
+    };
+
+    static size_t roundUpToPowerOfTwo(size_t value) {
+        size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    bool empty() const { return size() == 0; }
+    bool full() const { return size() > mask; }
+
+    bool enqueue(T &item) {
+        size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference =
+                static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(item);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::optional<T> dequeue() {
+        size_t position = dequeuePosition.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) -
+                                  static_cast<intptr_t>(position + 1);
+            if (difference == 0) {
+                if (dequeuePosition.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return std::nullopt;
+            } else {
+                position = dequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        std::optional<T> item(std::move(cell->value));
+        cell->sequence.store(position + mask + 1, std::memory_order_release);
+        return item;
+    }
+
+    // The seq_cst increment of waiters pairs with the fence in wake(): either
+    // the waker sees the waiter, or the waiter's predicate sees the change.
+    template<typename Predicate>
+    void park(std::condition_variable &condition, std::atomic<int> &waiters,
+              std::chrono::steady_clock::time_point until, Predicate ready) {
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        {
+            std::unique_lock<std::mutex> lock(parkMutex);
+            condition.wait_until(lock, until, ready);
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wake(std::condition_variable &condition, std::atomic<int> &waiters) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(parkMutex);
+            condition.notify_one();
+        }
+    }
+
+    const size_t mask;
+    std::vector<Cell> cells;
+    alignas(64) std::atomic<size_t> enqueuePosition{0};
+    alignas(64) std::atomic<size_t> dequeuePosition{0};
+    alignas(64) std::atomic<bool> closed{false};
+    std::atomic<int> producersWaiting{0};
+    std::atomic<int> consumersWaiting{0};
+    std::mutex parkMutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+#endif /* ringbuffer_hpp */
@@ -0,0 +1,133 @@
+#ifndef scheduler_hpp
+#define scheduler_hpp
+
+#include <ctime>
+#include <mutex>
+#include <queue>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstdint>
+
+/** Min-heap scheduler that gives every query its own polling cadence.
+ *
+ *  Each query owns a grid of slots spaced by its interval; the due time of
+ *  a slot is the slot start plus a random delay in [0, jitter]. The next
+ *  slot is computed from the previous slot, not from when a fetch finished,
+ *  so slow fetches do not stretch the cadence. Slots that already passed
+ *  by the time a query is dispatched are skipped and counted as missed. */
+class QueryScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct QueryStats {
+        size_t query = 0;
+        std::chrono::milliseconds interval{0};
+        uint64_t runs = 0;
+        uint64_t missedSlots = 0;
+        double lastLagSeconds = 0;      // Dispatch time - due time
+        double maxLagSeconds = 0;
+    };
+
+    /** Register a query that is first due at start (plus jitter). Query
+     *  indexes must be added in order 0, 1, 2, ... */
+    void add(std::chrono::milliseconds interval,
+             std::chrono::milliseconds jitter,
+             Clock::time_point start = Clock::now());
+
+    /** Change the interval used from the next slot on. */
+    void setInterval(size_t query, std::chrono::milliseconds interval);
+    std::chrono::milliseconds interval(size_t query) const;
+
+    /** Remove and return every query due at or before now, rescheduling
+     *  each one for its next slot. */
+    std::vector<size_t> takeDue(Clock::time_point now);
+
+    /** Due time of the earliest query; Clock::time_point::max() if none. */
+    Clock::time_point nextDue() const;
+
+    size_t size() const { return queries.size(); }
+    std::vector<QueryStats> stats() const;
+
+private:
+    struct Entry {
+        Clock::time_point due;
+        size_t query;
+        bool operator>(const Entry &other) const {
+            if (due != other.due) return due > other.due;
+            return query > other.query;
+        }
+    };
+
+    struct Query {
+        std::chrono::milliseconds interval;
+        std::chrono::milliseconds jitter;
+        Clock::time_point slot;
+        QueryStats stats;
+    };
+
+    Clock::time_point jittered(const Query &query);
+
+    std::vector<Query> queries;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+    std::mt19937_64 random{std::random_device{}()};
+};
+
+/** Splits a global request budget across queries by observed arrival rate.
+ *  Thread-safe.
+ *
+ *  Every poll reports the list_time of the ads it returned; ads newer than
+ *  the newest one seen by the previous poll of that query count as
+ *  arrivals. The rate of each query is an exponentially decayed
+ *  arrivals / observed-time ratio with a weak prior, so dead queries decay
+ *  towards the prior instead of zero.
+ *
+ *  With Poisson arrivals at rate r and polling interval T, an ad waits T/2
+ *  on average before it is seen. Minimizing the total expected delay
+ *  sum(r_i * T_i / 2) under a fixed budget sum(1 / T_i) = B gives polling
+ *  frequencies proportional to sqrt(r_i), clamped to [minInterval,
+ *  maxInterval] with the remaining budget re-split among the others. */
+class AdaptivePolicy {
+public:
+    struct QueryEstimate {
+        size_t query = 0;
+        double arrivalsPerHour = 0;
+        std::chrono::milliseconds interval{0};
+        double expectedDelaySeconds = 0;    // Mean time a new ad goes unseen
+    };
+
+    AdaptivePolicy(double requestsPerMinute,
+                   std::chrono::seconds minInterval,
+                   std::chrono::seconds maxInterval);
+
+    /** Register queries 0 .. count - 1. */
+    void resize(size_t count);
+
+    /** Record one poll of query that returned ads with these list times. */
+    void observe(size_t query, const std::vector<time_t> &listTimes,
+                 QueryScheduler::Clock::time_point now);
+
+    /** Recompute every interval from the current rate estimates. */
+    std::vector<QueryEstimate> allocate() const;
+
+private:
+    struct Estimate {
+        bool hasBaseline = false;
+        time_t newestListTime = 0;
+        double arrivals = 0;
+        double exposureSeconds = 0;
+        QueryScheduler::Clock::time_point lastPoll;
+    };
+
+    double rate(const Estimate &estimate) const;
+
+    // observe() runs on the diff stage, allocate() on the scheduling thread.
+    mutable std::mutex estimatesMutex;
+
+    double requestsPerSecond;
+    double minIntervalSeconds;
+    double maxIntervalSeconds;
+    std::vector<Estimate> estimates;
+};
+
+#endif /* scheduler_hpp */
@@ -0,0 +1,62 @@
+#ifndef seenadstore_hpp
+#define seenadstore_hpp
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include "helperfunctions.hpp"
+#include "mappedcache.hpp"
+
+/** Set of already announced ads with their last known price.
+ *
+ *  Entries live in a dense vector in insertion order (which is also the
+ *  order they are serialized in); an open-addressing table with linear
+ *  probing maps ad id -> position in that vector, giving O(1) lookups and
+ *  upserts regardless of how many ids have been seen.
+ *
+ *  Optionally the store sits on top of a read-only memory-mapped binary
+ *  snapshot: lookups fall through to it and the hash table only holds ads
+ *  added or changed since that snapshot was written. */
+class SeenAdStore {
+public:
+    SeenAdStore() = default;
+    explicit SeenAdStore(const std::vector<AdPrice> &entries);
+
+    /** Last known price of the ad, or nullopt if it was never seen. */
+    std::optional<int> find(int id) const;
+
+    /** Insert the ad or update its price. Returns true if the id is new. */
+    bool upsert(int id, int price);
+
+    void reserve(size_t count);
+    void clear();
+
+    /** Use base as the underlying snapshot and drop all in-memory entries,
+     *  which the caller guarantees base already contains. */
+    void rebase(std::shared_ptr<const MappedCache> base);
+
+    size_t size() const {
+        return (base ? base->size() : 0) + idsMissingFromBase;
+    }
+    bool empty() const { return size() == 0; }
+
+    /** All entries: the base snapshot (with updated prices) followed by new
+     *  ads in insertion order. */
+    std::vector<AdPrice> snapshot() const;
+
+private:
+    static constexpr uint32_t EMPTY_SLOT = 0;
+
+    size_t slotFor(int id) const;
+    void rehash(size_t slotCount);
+
+    std::shared_ptr<const MappedCache> base;
+    size_t idsMissingFromBase = 0;
+
+    std::vector<AdPrice> items;
+    // 0 marks an empty slot, any other value is an index into items + 1.
+    std::vector<uint32_t> slots;
+};
+
+#endif /* seenadstore_hpp */
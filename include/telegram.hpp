@@ -1,17 +1,143 @@
 #ifndef TELEGRAM_HPP
 #define TELEGRAM_HPP
 
+#include <map>
+#include <mutex>
+#include <queue>
+#include <chrono>
 #include <string>
+#include <thread>
+#include <vector>
 #include <cstdint>
+#include <utility>
+#include <optional>
+#include <nlohmann/json.hpp>
 #include "kufar.hpp"
+#include "ringbuffer.hpp"
+#include "tokenbucket.hpp"
 
 namespace Telegram {
+    const std::string DEFAULT_API_URL = "https://api.telegram.org";
+
     struct TelegramConfiguration {
         std::string botToken;
-        uint64_t chatID;
+        // Negative for groups and channels.
+        int64_t chatID;
+        // Overridable so the client can be pointed at a local mock server.
+        std::string apiURL = DEFAULT_API_URL;
+        // Timezone of dates in messages; Kufar is in Minsk (UTC+3).
+        int utcOffsetMinutes = 180;
+    };
+
+    /** Outcome of one Bot API call, parsed from its response body. */
+    struct DeliveryResult {
+        bool ok = false;
+        bool retryable = false;                 // Transport error or 5xx
+        std::optional<int> errorCode;
+        std::optional<int> retryAfterSeconds;   // parameters.retry_after of a 429
+        std::string description;
+    };
+
+    /** sendMediaGroup "media" array of up to 10 photos; the first one
+     *  carries the caption. */
+    nlohmann::json makeImageGroupJSON(const std::vector<std::string> &images,
+                                      const std::string &caption);
+    DeliveryResult parseDeliveryResult(const std::string &response);
+    DeliveryResult sendAdvert(const TelegramConfiguration &, const Kufar::Ad &);
+
+    struct DeliveryStats {
+        uint64_t delivered = 0;
+        uint64_t failed = 0;
+        uint64_t throttled = 0;         // 429 responses
+        uint64_t retried = 0;
+        double totalLatencySeconds = 0; // Enqueue -> successful delivery
+        double maxLatencySeconds = 0;
     };
 
-    void sendAdvert(const TelegramConfiguration &, const Kufar::Ad &);
+    /** Delivers adverts from a bounded queue on a dedicated thread, so the
+     *  scan loop never waits for the Telegram API. One Sender serves every
+     *  destination; each advert names the bot and chat it goes to.
+     *
+     *  Sends are paced by a token bucket per bot and one per chat that
+     *  follow the Bot API limits (about 30 messages per second per bot, one
+     *  per second to a private chat, 20 per minute to a group); an album
+     *  costs one message per photo. A 429 pauses the chat for retry_after
+     *  seconds and the message is rescheduled, up to MAX_THROTTLED_ATTEMPTS
+     *  times; transport and 5xx errors are retried with exponential
+     *  backoff. */
+    class Sender {
+    public:
+        Sender(const TelegramConfiguration &configuration,
+               size_t queueCapacity);
+        ~Sender();
+
+        Sender(const Sender &) = delete;
+        Sender &operator=(const Sender &) = delete;
+
+        void start();
+
+        /** Queue an advert for delivery to the configured chat. Blocks
+         *  while the queue is full; returns false once shutdown() has been
+         *  called. */
+        bool enqueue(const Kufar::Ad &ad);
+        /** Same, to another bot and chat. */
+        bool enqueue(const Kufar::Ad &ad,
+                     const TelegramConfiguration &destination);
+
+        /** Stop accepting adverts, deliver everything already queued and
+         *  join the sender thread. Messages still throttled after
+         *  DRAIN_TIMEOUT are dropped. */
+        void shutdown();
+
+        size_t pending() const { return queue.size(); }
+        size_t capacity() const { return queue.capacity(); }
+        DeliveryStats stats() const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr int MAX_ATTEMPTS = 5;
+        static constexpr int MAX_THROTTLED_ATTEMPTS = 10;
+        static constexpr std::chrono::seconds DRAIN_TIMEOUT{30};
+
+        struct Delivery {
+            Kufar::Ad ad;
+            TelegramConfiguration destination;
+            Clock::time_point enqueuedAt;
+            Clock::time_point readyAt;
+            uint64_t sequence = 0;
+            int attempts = 0;
+            int throttledAttempts = 0;
+        };
+
+        struct LaterFirst {
+            bool operator()(const Delivery &a, const Delivery &b) const {
+                if (a.readyAt != b.readyAt) return a.readyAt > b.readyAt;
+                return a.sequence > b.sequence;
+            }
+        };
+
+        void run();
+        void schedule(Delivery delivery);
+        void deliver(Delivery delivery);
+        TokenBucket &botBucket(const std::string &botToken);
+        TokenBucket &chatBucket(const TelegramConfiguration &destination);
+
+        const TelegramConfiguration configuration;
+        RingBuffer<Delivery> queue;
+        std::thread worker;
+
+        // Owned by the sender thread.
+        std::priority_queue<Delivery, std::vector<Delivery>, LaterFirst> scheduled;
+        std::map<std::string, TokenBucket> botBuckets;
+        // Telegram limits each bot per chat, so tenants with their own bots
+        // in one chat do not share a bucket.
+        std::map<std::pair<std::string, int64_t>, TokenBucket> chatBuckets;
+        uint64_t nextSequence = 0;
+
+        mutable std::mutex statsMutex;
+        DeliveryStats deliveryStats;
+    };
 };
 
 #endif /* TELEGRAM_HPP */
@@ -0,0 +1,21 @@
+#ifndef tenant_hpp
+#define tenant_hpp
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "telegram.hpp"
+#include "seenadstore.hpp"
+#include "cachejournal.hpp"
+
+/** One client of a shared scanner: the chats its adverts go to and the ads
+ *  it has already been told about. Tenants share the scheduler, the
+ *  connection pool, the Sender and parsed results; nothing here is shared. */
+struct Tenant {
+    std::string name;
+    std::vector<Telegram::TelegramConfiguration> chats;
+    SeenAdStore seenAds;
+    std::unique_ptr<CacheJournal> cacheJournal;
+};
+
+#endif /* tenant_hpp */
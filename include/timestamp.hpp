@@ -0,0 +1,150 @@
+#ifndef timestamp_hpp
+#define timestamp_hpp
+
+#include <ctime>
+#include <string>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+/** Calendar arithmetic on UTC timestamps without tm, locales or the
+ *  timezone lock taken by mktime/localtime. */
+namespace Timestamp {
+    /** Days since 1970-01-01 of a proleptic Gregorian date
+     *  (Howard Hinnant's days_from_civil). */
+    constexpr int64_t daysFromCivil(int64_t year, unsigned month, unsigned day) {
+        year -= month <= 2;
+        const int64_t era = (year >= 0 ? year : year - 399) / 400;
+        const unsigned yearOfEra = static_cast<unsigned>(year - era * 400);
+        const unsigned dayOfYear =
+            (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        const unsigned dayOfEra =
+            yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + static_cast<int64_t>(dayOfEra) - 719468;
+    }
+
+    struct CivilDate {
+        int64_t year;
+        unsigned month;     // 1 .. 12
+        unsigned day;       // 1 .. 31
+    };
+
+    /** Inverse of daysFromCivil(). */
+    constexpr CivilDate civilFromDays(int64_t days) {
+        days += 719468;
+        const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+        const unsigned dayOfEra = static_cast<unsigned>(days - era * 146097);
+        const unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 +
+            dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        const unsigned dayOfYear =
+            dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        const unsigned monthIndex = (5 * dayOfYear + 2) / 153;
+        const unsigned day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+        const unsigned month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+        return {static_cast<int64_t>(yearOfEra) + era * 400 + (month <= 2),
+                month, day};
+    }
+
+    namespace detail {
+        constexpr bool digits(std::string_view s, size_t pos, size_t count,
+                              unsigned &value) {
+            if (pos + count > s.size()) {
+                return false;
+            }
+            value = 0;
+            for (size_t i = pos; i < pos + count; i++) {
+                if (s[i] < '0' || s[i] > '9') {
+                    return false;
+                }
+                value = value * 10 + static_cast<unsigned>(s[i] - '0');
+            }
+            return true;
+        }
+
+        constexpr bool isLeapYear(unsigned year) {
+            return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+        }
+
+        constexpr unsigned daysInMonth(unsigned year, unsigned month) {
+            constexpr unsigned lengths[] =
+                {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+            return month == 2 && isLeapYear(year) ? 29 : lengths[month - 1];
+        }
+    }
+
+    /** Parse "YYYY-MM-DDThh:mm:ss" with optional fractional seconds and an
+     *  optional "Z" or "+hh:mm"/"-hh:mm" suffix; no suffix means UTC.
+     *  Returns seconds since the epoch, or nullopt if the text is not in
+     *  that form. */
+    constexpr std::optional<time_t> parseISO8601(std::string_view text) {
+        unsigned year = 0, month = 0, day = 0;
+        unsigned hour = 0, minute = 0, second = 0;
+        if (!detail::digits(text, 0, 4, year) || text.size() < 19 ||
+            text[4] != '-' || !detail::digits(text, 5, 2, month) ||
+            text[7] != '-' || !detail::digits(text, 8, 2, day) ||
+            (text[10] != 'T' && text[10] != ' ') ||
+            !detail::digits(text, 11, 2, hour) || text[13] != ':' ||
+            !detail::digits(text, 14, 2, minute) || text[16] != ':' ||
+            !detail::digits(text, 17, 2, second)) {
+            return std::nullopt;
+        }
+        // 60 is a leap second; it folds into the next minute like timegm.
+        if (month < 1 || month > 12 || day < 1 ||
+            day > detail::daysInMonth(year, month) ||
+            hour > 23 || minute > 59 || second > 60) {
+            return std::nullopt;
+        }
+
+        size_t pos = 19;
+        if (pos < text.size() && text[pos] == '.') {
+            pos++;
+            size_t fractionStart = pos;
+            while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9') {
+                pos++;
+            }
+            if (pos == fractionStart) {
+                return std::nullopt;
+            }
+        }
+
+        int64_t offsetSeconds = 0;
+        if (pos < text.size()) {
+            if (text[pos] == 'Z' || text[pos] == 'z') {
+                pos++;
+            } else if (text[pos] == '+' || text[pos] == '-') {
+                unsigned offsetHours = 0, offsetMinutes = 0;
+                if (!detail::digits(text, pos + 1, 2, offsetHours) ||
+                    pos + 3 >= text.size() || text[pos + 3] != ':' ||
+                    !detail::digits(text, pos + 4, 2, offsetMinutes) ||
+                    offsetHours > 23 || offsetMinutes > 59) {
+                    return std::nullopt;
+                }
+                offsetSeconds =
+                    static_cast<int64_t>(offsetHours * 3600 + offsetMinutes * 60) *
+                    (text[pos] == '+' ? 1 : -1);
+                pos += 6;
+            }
+        }
+        if (pos != text.size()) {
+            return std::nullopt;
+        }
+
+        return static_cast<time_t>(
+            daysFromCivil(year, month, day) * 86400 +
+            hour * 3600 + minute * 60 + second - offsetSeconds);
+    }
+
+    /** Format like ctime() without the trailing newline, e.g.
+     *  "Mon Jan 15 13:30:00 2024", shifted to UTC+utcOffsetMinutes. */
+    std::string format(time_t timestamp, int utcOffsetMinutes);
+
+    static_assert(daysFromCivil(1970, 1, 1) == 0);
+    static_assert(daysFromCivil(2000, 3, 1) == 11017);
+    static_assert(civilFromDays(11016).day == 29);
+    static_assert(parseISO8601("2024-01-15T10:30:00Z").value() == 1705314600);
+    static_assert(parseISO8601("2024-01-15T13:30:00+03:00").value() == 1705314600);
+    static_assert(parseISO8601("2024-01-15T07:30:00-03:00").value() == 1705314600);
+    static_assert(!parseISO8601("2023-02-29T00:00:00Z").has_value());
+}
+
+#endif /* timestamp_hpp */
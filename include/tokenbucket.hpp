@@ -0,0 +1,59 @@
+#ifndef tokenbucket_hpp
+#define tokenbucket_hpp
+
+#include <chrono>
+#include <algorithm>
+
+/** Token bucket rate limiter driven by explicit timestamps.
+ *
+ *  A request may go once the bucket holds min(cost, capacity) tokens; the
+ *  full cost is then taken, so expensive requests leave the bucket in debt
+ *  instead of never fitting. pauseUntil() blocks the bucket entirely, e.g.
+ *  for a server-provided retry_after. Not thread-safe. */
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket(double ratePerSecond, double capacity)
+        : rate(ratePerSecond), maxTokens(capacity), tokens(capacity),
+          updatedAt(Clock::now()), pausedUntil(updatedAt) {}
+
+    /** Earliest time at which a request of the given cost may be sent. */
+    Clock::time_point readyAt(Clock::time_point now, double cost = 1) const {
+        const double needed = std::min(cost, maxTokens);
+        const double available = tokensAt(now);
+        Clock::time_point ready = now;
+        if (available < needed) {
+            ready = now + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>((needed - available) / rate));
+        }
+        return std::max(ready, pausedUntil);
+    }
+
+    void take(Clock::time_point now, double cost = 1) {
+        tokens = tokensAt(now) - cost;
+        updatedAt = now;
+    }
+
+    void pauseUntil(Clock::time_point until) {
+        pausedUntil = std::max(pausedUntil, until);
+    }
+
+private:
+    double tokensAt(Clock::time_point now) const {
+        if (now <= updatedAt) {
+            return tokens;
+        }
+        const double elapsed =
+            std::chrono::duration<double>(now - updatedAt).count();
+        return std::min(maxTokens, tokens + elapsed * rate);
+    }
+
+    double rate;
+    double maxTokens;
+    double tokens;
+    Clock::time_point updatedAt;
+    Clock::time_point pausedUntil;
+};
+
+#endif /* tokenbucket_hpp */
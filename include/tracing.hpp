@@ -0,0 +1,93 @@
+#ifndef tracing_hpp
+#define tracing_hpp
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+
+/** Span tracing in the Chrome trace event format (chrome://tracing,
+ *  ui.perfetto.dev).
+ *
+ *  Every thread records into its own bounded buffer, keeping the newest
+ *  events when it fills up; the lock that guards a buffer is only ever
+ *  contended by dump(). Nothing is recorded until enable() is called, and
+ *  a disabled Span costs one relaxed load. Names and categories must be
+ *  string literals; anything variable goes into the args. */
+namespace Tracing {
+    using Clock = std::chrono::steady_clock;
+
+    namespace detail {
+        extern std::atomic<bool> enabled;
+    }
+
+    void enable();
+
+    inline bool isEnabled() {
+        return detail::enabled.load(std::memory_order_relaxed);
+    }
+
+    /** Name shown for the calling thread's track. */
+    void setThreadName(const std::string &name);
+
+    /** A complete ("X") event on the calling thread. Spans on one thread
+     *  must nest, which scoped use guarantees. */
+    void complete(const char *name, const char *category,
+                  Clock::time_point begin, Clock::time_point end,
+                  const std::string &args = "");
+
+    /** A begin/end ("b"/"e") pair on a track of its own, for work that
+     *  overlaps other work on the same thread. Pairs with the same category
+     *  and id nest. */
+    void async(const char *name, const char *category, uint64_t id,
+               Clock::time_point begin, Clock::time_point end,
+               const std::string &args = "");
+    uint64_t nextAsyncId();
+
+    /** Appends "key":value to args, a comma-separated list of JSON members. */
+    void addArg(std::string &args, const char *key, const std::string &value);
+    void addArg(std::string &args, const char *key, int64_t value);
+
+    /** Records the time between construction and destruction. */
+    class Span {
+    public:
+        Span(const char *name, const char *category)
+            : active(isEnabled()), name(name), category(category) {
+            if (active) {
+                begin = Clock::now();
+            }
+        }
+        ~Span() {
+            if (active) {
+                complete(name, category, begin, Clock::now(), args);
+            }
+        }
+        Span(const Span &) = delete;
+        Span &operator=(const Span &) = delete;
+
+        void arg(const char *key, const std::string &value) {
+            if (active) addArg(args, key, value);
+        }
+        void arg(const char *key, int64_t value) {
+            if (active) addArg(args, key, value);
+        }
+
+    private:
+        bool active;
+        const char *name;
+        const char *category;
+        Clock::time_point begin;
+        std::string args;
+    };
+
+    /** Async-signal-safe; the owner of the trace polls dumpRequested(). */
+    void requestDump();
+    /** True once per requestDump(). */
+    bool dumpRequested();
+
+    /** Write every buffered event as a Chrome trace JSON file. Throws on
+     *  I/O errors. Returns the number of events written. */
+    size_t dump(const std::string &path);
+};
+
+#endif /* tracing_hpp */
@@ -0,0 +1,47 @@
+#ifndef watermarkstore_hpp
+#define watermarkstore_hpp
+
+#include <ctime>
+#include <string>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+
+/** Newest ad a query has returned so far. */
+struct Watermark {
+    time_t listTime = 0;
+    int id = 0;
+};
+
+/** Per-query high-watermarks, persisted as a small JSON object keyed by the
+ *  query plan's hash, so they survive restarts and reordering of the
+ *  configuration. Not thread-safe; the diff stage owns it. */
+class WatermarkStore {
+public:
+    explicit WatermarkStore(const std::string &path);
+
+    /** Read the file; a missing file leaves the store empty. Throws on
+     *  malformed contents. */
+    void load();
+
+    /** Rewrite the file atomically if anything changed since the last
+     *  load() or save(). Throws on I/O errors. */
+    void save();
+
+    std::optional<Watermark> get(uint64_t query) const;
+
+    /** Raise the watermark of query to mark if mark is newer (by list
+     *  time, then id). Returns true if it moved. */
+    bool advance(uint64_t query, const Watermark &mark);
+
+    bool isDirty() const { return dirty; }
+    size_t size() const { return marks.size(); }
+    const std::string &path() const { return filePath; }
+
+private:
+    std::string filePath;
+    std::unordered_map<uint64_t, Watermark> marks;
+    bool dirty = false;
+};
+
+#endif /* watermarkstore_hpp */
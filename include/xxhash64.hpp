@@ -0,0 +1,31 @@
+#ifndef xxhash64_hpp
+#define xxhash64_hpp
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+/** Streaming XXH64 (xxHash, 64-bit variant). Feeding the input in any
+ *  number of chunks gives the same digest as hashing it in one piece,
+ *  so a response body can be hashed while it is still being received. */
+class XXHash64 {
+public:
+    explicit XXHash64(uint64_t seed = 0);
+
+    void update(const void *data, size_t length);
+    uint64_t digest() const;
+
+    static uint64_t hash(const void *data, size_t length, uint64_t seed = 0);
+    static uint64_t hash(const std::string &text, uint64_t seed = 0) {
+        return hash(text.data(), text.size(), seed);
+    }
+
+private:
+    uint64_t accumulators[4];
+    uint64_t seed;
+    uint64_t totalLength = 0;
+    unsigned char buffer[32];
+    size_t buffered = 0;
+};
+
+#endif /* xxhash64_hpp */
@@ -0,0 +1,210 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <nlohmann/json.hpp>
+#include "cachejournal.hpp"
+#include "helperfunctions.hpp"
+#include "logging.hpp"
+
+using namespace std;
+using nlohmann::json;
+
+namespace {
+    const uint32_t RECORD_MAGIC = 0x4A444153; // "SADJ"
+
+    struct JournalRecord {
+        uint32_t magic;
+        int32_t id;
+        int32_t price;
+        uint32_t checksum;
+    };
+    static_assert(sizeof(JournalRecord) == 16, "journal record must be packed");
+
+    uint32_t recordChecksum(const JournalRecord &record) {
+        // FNV-1a over the payload; enough to reject torn or garbage tails.
+        uint32_t hash = 2166136261u;
+        const unsigned char *bytes =
+            reinterpret_cast<const unsigned char *>(&record);
+        for (size_t i = 0; i < offsetof(JournalRecord, checksum); i++) {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    runtime_error ioError(const string &what, const string &path) {
+        return runtime_error(what + " \"" + path + "\": " + strerror(errno));
+    }
+}
+
+CacheJournal::CacheJournal(const string &snapshotPath)
+    : snapshotPath(snapshotPath), journalPath(snapshotPath + ".journal") {}
+
+CacheJournal::~CacheJournal() {
+    if (fd >= 0) {
+        if (unsyncedRecords > 0) {
+            fsync(fd);
+        }
+        close(fd);
+    }
+}
+
+size_t CacheJournal::load(SeenAdStore &store) {
+    loadSnapshot(store);
+    return replay(store);
+}
+
+void CacheJournal::loadSnapshot(SeenAdStore &store) {
+    store.clear();
+
+    if (!fileExists(snapshotPath)) {
+        Log::info("Cache file not found, creating empty cache");
+        snapshotFormat = Format::json;
+        saveFileAtomically(snapshotPath, json::array().dump());
+        return;
+    }
+
+    if (MappedCache::isBinaryCache(snapshotPath)) {
+        auto base = make_shared<MappedCache>();
+        base->open(snapshotPath);
+        snapshotFormat = Format::binary;
+        store.rebase(std::move(base));
+        return;
+    }
+
+    snapshotFormat = Format::json;
+    ifstream ifs(snapshotPath);
+    json contents;
+    try {
+        contents = json::parse(ifs);
+    } catch (const exception &exc) {
+        throw runtime_error("cannot parse \"" + snapshotPath + "\": " +
+                            exc.what());
+    }
+    store = SeenAdStore(contents.get<vector<AdPrice>>());
+}
+
+size_t CacheJournal::replay(SeenAdStore &store) {
+    size_t replayed = 0;
+    off_t validLength = 0;
+
+    int readFd = open(journalPath.c_str(), O_RDONLY);
+    if (readFd >= 0) {
+        JournalRecord record;
+        while (true) {
+            ssize_t n = read(readFd, &record, sizeof(record));
+            if (n != static_cast<ssize_t>(sizeof(record)) ||
+                record.magic != RECORD_MAGIC ||
+                record.checksum != recordChecksum(record)) {
+                break;
+            }
+            store.upsert(record.id, record.price);
+            validLength += sizeof(record);
+            replayed++;
+        }
+        off_t fileLength = lseek(readFd, 0, SEEK_END);
+        close(readFd);
+
+        if (fileLength > validLength) {
+            Log::warn("Cache journal has a damaged tail, dropping " +
+                      to_string(fileLength - validLength) + " bytes");
+            if (truncate(journalPath.c_str(), validLength) != 0) {
+                throw ioError("Cannot truncate journal", journalPath);
+            }
+        }
+    } else if (errno != ENOENT) {
+        throw ioError("Cannot open journal", journalPath);
+    }
+
+    records = replayed;
+    openForAppend();
+    return replayed;
+}
+
+void CacheJournal::openForAppend() {
+    if (fd >= 0) {
+        close(fd);
+    }
+    fd = open(journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        throw ioError("Cannot open journal", journalPath);
+    }
+}
+
+void CacheJournal::append(int id, int price) {
+    if (fd < 0) {
+        openForAppend();
+    }
+
+    JournalRecord record{RECORD_MAGIC, id, price, 0};
+    record.checksum = recordChecksum(record);
+    if (write(fd, &record, sizeof(record)) !=
+        static_cast<ssize_t>(sizeof(record))) {
+        throw ioError("Cannot append to journal", journalPath);
+    }
+
+    records++;
+    if (++unsyncedRecords >= SYNC_BATCH) {
+        sync();
+    }
+}
+
+void CacheJournal::sync() {
+    if (fd < 0 || unsyncedRecords == 0) {
+        return;
+    }
+    if (fsync(fd) != 0) {
+        throw ioError("Cannot fsync journal", journalPath);
+    }
+    unsyncedRecords = 0;
+}
+
+bool CacheJournal::needsCompaction(const SeenAdStore &store) const {
+    if (snapshotFormat == Format::binary) {
+        return records >= MAX_BINARY_JOURNAL_RECORDS;
+    }
+    return records >= MIN_COMPACTION_RECORDS && records > store.size();
+}
+
+void CacheJournal::compact(SeenAdStore &store) {
+    // The snapshot is replaced atomically before the journal is emptied.
+    // Crashing in between is harmless: replaying the old journal over the
+    // new snapshot yields the same state.
+    if (snapshotFormat == Format::binary) {
+        MappedCache::write(snapshotPath, store.snapshot());
+        auto base = make_shared<MappedCache>();
+        base->open(snapshotPath);
+        store.rebase(std::move(base));
+    } else {
+        saveFileAtomically(snapshotPath, ((json)store.snapshot()).dump());
+    }
+
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (truncate(journalPath.c_str(), 0) != 0 && errno != ENOENT) {
+        throw ioError("Cannot truncate journal", journalPath);
+    }
+    records = 0;
+    unsyncedRecords = 0;
+    openForAppend();
+}
+
+void CacheJournal::convertToBinary(SeenAdStore &store) {
+    if (snapshotFormat == Format::binary) {
+        return;
+    }
+    const string backupPath = snapshotPath + ".bak";
+    if (fileExists(snapshotPath) &&
+        rename(snapshotPath.c_str(), backupPath.c_str()) != 0) {
+        throw ioError("Cannot back up snapshot to", backupPath);
+    }
+    snapshotFormat = Format::binary;
+    compact(store);
+}
@@ -7,10 +7,15 @@
 #include <optional>
 #include <cstdint>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
 #include <limits.h>
 #include <iostream>
 #include <libgen.h>
 #include "helperfunctions.hpp"
+#include "timestamp.hpp"
 
 using namespace std;
 
@@ -76,15 +81,11 @@ string getTextFromFile(const string &path) {
 }
 
 time_t zuluToTimestamp(const string &zuluDate) {
-    tm t{};
-    istringstream stringStream(zuluDate);
-
-    stringStream >> get_time(&t, "%Y-%m-%dT%H:%M:%S");
-    if (stringStream.fail()) {
+    optional<time_t> timestamp = Timestamp::parseISO8601(zuluDate);
+    if (!timestamp.has_value()) {
         throw runtime_error{"failed to parse time string"};
     }
-
-    return mktime(&t);
+    return timestamp.value();
 }
 
 string joinIntVector(const vector<int> &nums, const string &delim) {
@@ -100,10 +101,6 @@ string joinIntVector(const vector<int> &nums, const string &delim) {
     return temp;
 }
 
-time_t timestampShift(const time_t &timestamp, int shift) {
-    return timestamp + (3600 * shift);
-}
-
 bool stringHasPrefix(const string &originalString, const string &prefix) {
     return originalString.rfind(prefix, 0) == 0;
 }
@@ -115,6 +112,44 @@ void saveFile(const string &path, const string &contents) {
     ofs.close();
 }
 
+void saveFileAtomically(const string &path, const string &contents) {
+    const string temporaryPath = path + ".tmp";
+    int fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw runtime_error("cannot open \"" + temporaryPath + "\": " +
+                            strerror(errno));
+    }
+
+    size_t written = 0;
+    while (written < contents.size()) {
+        ssize_t n = write(fd, contents.data() + written,
+                          contents.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            string reason = strerror(errno);
+            close(fd);
+            throw runtime_error("cannot write \"" + temporaryPath + "\": " +
+                                reason);
+        }
+        written += static_cast<size_t>(n);
+    }
+
+    if (fsync(fd) != 0) {
+        string reason = strerror(errno);
+        close(fd);
+        throw runtime_error("cannot fsync \"" + temporaryPath + "\": " +
+                            reason);
+    }
+    close(fd);
+
+    if (rename(temporaryPath.c_str(), path.c_str()) != 0) {
+        throw runtime_error("cannot rename \"" + temporaryPath + "\": " +
+                            strerror(errno));
+    }
+}
+
 #ifdef __APPLE__
     #include <mach-o/dyld.h>
     #include <filesystem>
@@ -3,8 +3,11 @@
 #include "networking.hpp"
 #include "helperfunctions.hpp"
 #include "logging.hpp"
+#include "tracing.hpp"
 #include <iostream>
 #include <sstream> 
+#include <algorithm>
+#include <unordered_map>
 
 namespace Kufar {
 
@@ -16,6 +19,8 @@ namespace Kufar {
         "https://searchapi.kufar.by/v1/search/"
         "rendered-paginated?";
     const string DEFAULT_MAX_PRICE = "1000000000";
+    // Page size Kufar answers with when a search has no "size".
+    const int DEFAULT_LIMIT = 30;
 
     optional<string> PriceRange::joinPrice() const {
         if (!priceMin.has_value() && !priceMax.has_value()) { return nullopt; }
@@ -111,8 +116,7 @@ namespace Kufar {
         }
     }
 
-    vector<Ad> getAds(const KufarConfiguration &configuration) {
-        vector<Ad> adverts;
+    string getSearchURL(const KufarConfiguration &configuration) {
         ostringstream urlStream;
         urlStream << baseURL;
 
@@ -160,78 +164,730 @@ namespace Kufar {
                     configuration.areas.value(), ","));
         }
 
-        string rawJson = getJSONFromURL(urlStream.str());
-        json ads;
-        try {
-            json j = json::parse(rawJson);
-            ads = j.at("ads");
-        } catch (const std::exception &e) {
-            Log::error("getAds: JSON parse or .at(ads) failed: " + string(e.what()) +
-                       " (response length=" + to_string(rawJson.size()) + ")");
-            throw;
+        return urlStream.str();
+    }
+
+    namespace {
+        uint64_t fnv1a64(const string &bytes) {
+            uint64_t hash = 14695981039346656037ull;
+            for (unsigned char c : bytes) {
+                hash ^= c;
+                hash *= 1099511628211ull;
+            }
+            return hash;
         }
+    }
+
+    bool LocalFilter::empty() const {
+        return !priceMin.has_value() && !priceMax.has_value() &&
+               !region.has_value() && !areas.has_value() &&
+               !condition.has_value() && !companyOnly && !photosOnly;
+    }
+
+    bool LocalFilter::matches(const Ad &advert) const {
+        if ((priceMin.has_value() && advert.price < priceMin.value()) ||
+            (priceMax.has_value() && advert.price > priceMax.value())) {
+            return false;
+        }
+        if (region.has_value() && advert.region != region) {
+            return false;
+        }
+        if (areas.has_value() &&
+            (!advert.area.has_value() ||
+             !vectorContains(areas.value(), advert.area.value()))) {
+            return false;
+        }
+        if (condition.has_value() && advert.condition != condition) {
+            return false;
+        }
+        return (!companyOnly || advert.companyAd) &&
+               (!photosOnly || !advert.images.empty());
+    }
 
-        for (const auto &ad : ads) {
-            Ad advert;
+    bool QueryPlan::filtersLocally() const {
+        return any_of(members.begin(), members.end(),
+                      [](const PlanMember &member) { return !member.filter.empty(); });
+    }
 
-            if (configuration.tag.has_value()) {
-                advert.tag = configuration.tag.value();
+    bool QueryPlan::matches(const Ad &advert) const {
+        return any_of(members.begin(), members.end(),
+                      [&](const PlanMember &member) {
+                          return member.filter.matches(advert);
+                      });
+    }
+
+    namespace {
+        // Price ranges are in the request's currency, but ads only carry
+        // price_byn.
+        bool priceIsComparable(const KufarConfiguration &configuration) {
+            return !configuration.currency.has_value() ||
+                   configuration.currency.value() == "BYR";
+        }
+
+        bool isCompanyOnly(const KufarConfiguration &configuration) {
+            // "cmp" is only sent for companies; individuals are not filtered.
+            return configuration.sellerType == SellerType::company;
+        }
+
+        // The request left when the locally checkable filters are removed;
+        // configurations with equal keys can share one request.
+        string coalescingKey(KufarConfiguration configuration) {
+            if (priceIsComparable(configuration)) {
+                configuration.priceRange = PriceRange();
             }
+            configuration.limit.reset();
+            configuration.region.reset();
+            configuration.areas.reset();
+            configuration.condition.reset();
+            configuration.sellerType.reset();
+            configuration.onlyWithPhotos.reset();
+            return getSearchURL(configuration);
+        }
 
-            advert.title = ad.at("subject");
-            advert.id = ad.at("ad_id");
-            advert.date = timestampShift(
-                zuluToTimestamp(
-                    (string)ad.at("list_time")), 3);
-            advert.price = stoi((string)ad.at("price_byn"));
-            advert.phoneNumberIsVisible = !ad.at("phone_hidden");
-            advert.link = ad.at("ad_link");
+        template<typename T, typename Merge>
+        optional<T> mergeIfAll(const vector<const KufarConfiguration *> &members,
+                               optional<T> KufarConfiguration::*field,
+                               Merge merge) {
+            optional<T> merged = (*members.front()).*field;
+            for (const KufarConfiguration *member : members) {
+                const optional<T> &value = member->*field;
+                if (!merged.has_value() || !value.has_value()) {
+                    return nullopt;
+                }
+                merged = merge(merged.value(), value.value());
+            }
+            return merged;
+        }
 
-            json accountParameters = ad.at("account_parameters");
-            for (const auto &accountParameter : accountParameters) {
-                if (accountParameter.at("p") == "name") {
-                    advert.sellerName = accountParameter.at("v");
+        // The narrowest request whose results contain those of every member.
+        KufarConfiguration broaden(const vector<const KufarConfiguration *> &members) {
+            KufarConfiguration broad = *members.front();
+            // Every member must still get at least the page it asked for.
+            for (const KufarConfiguration *member : members) {
+                if (member->limit.has_value()) {
+                    int limit = 0;
+                    for (const KufarConfiguration *other : members) {
+                        limit = max(limit, other->limit.value_or(DEFAULT_LIMIT));
+                    }
+                    broad.limit = limit;
                     break;
                 }
             }
 
-            // Parse region and area (city) from ad parameters if present
-            if (ad.contains("ad_parameters")) {
-                json adParams = ad.at("ad_parameters");
-                for (const auto &param : adParams) {
+            if (priceIsComparable(broad)) {
+                PriceRange range;
+                range.priceMin = members.front()->priceRange.priceMin;
+                range.priceMax = members.front()->priceRange.priceMax;
+                for (const KufarConfiguration *member : members) {
+                    const PriceRange &price = member->priceRange;
+                    range.priceMin = range.priceMin.has_value() && price.priceMin.has_value()
+                        ? optional<int>(min(range.priceMin.value(), price.priceMin.value()))
+                        : nullopt;
+                    range.priceMax = range.priceMax.has_value() && price.priceMax.has_value()
+                        ? optional<int>(max(range.priceMax.value(), price.priceMax.value()))
+                        : nullopt;
+                }
+                broad.priceRange = range;
+            }
+
+            for (const KufarConfiguration *member : members) {
+                if (member->region != broad.region) {
+                    broad.region.reset();
+                }
+                if (member->condition != broad.condition) {
+                    broad.condition.reset();
+                }
+                if (!isCompanyOnly(*member)) {
+                    broad.sellerType.reset();
+                }
+                if (member->onlyWithPhotos != true) {
+                    broad.onlyWithPhotos.reset();
+                }
+            }
+
+            broad.areas = mergeIfAll(members, &KufarConfiguration::areas,
+                [](vector<int> a, const vector<int> &b) {
+                    a.insert(a.end(), b.begin(), b.end());
+                    sort(a.begin(), a.end());
+                    a.erase(unique(a.begin(), a.end()), a.end());
+                    return a;
+                });
+            return broad;
+        }
+
+        // What member filters beyond the broad request.
+        LocalFilter localFilter(const KufarConfiguration &member,
+                                const KufarConfiguration &broad) {
+            LocalFilter filter;
+            if (priceIsComparable(member)) {
+                const PriceRange &price = member.priceRange;
+                const PriceRange &requested = broad.priceRange;
+                if (price.priceMin.has_value() &&
+                    price.priceMin != requested.priceMin) {
+                    filter.priceMin = price.priceMin.value() * 100;
+                }
+                if (price.priceMax.has_value() &&
+                    price.priceMax != requested.priceMax) {
+                    filter.priceMax = price.priceMax.value() * 100;
+                }
+            }
+            if (member.region.has_value() && !broad.region.has_value()) {
+                filter.region = member.region;
+            }
+            if (member.areas.has_value() && member.areas != broad.areas) {
+                filter.areas = member.areas;
+            }
+            if (member.condition.has_value() && !broad.condition.has_value()) {
+                filter.condition = member.condition;
+            }
+            filter.companyOnly = isCompanyOnly(member) && !isCompanyOnly(broad);
+            filter.photosOnly = member.onlyWithPhotos == true &&
+                                broad.onlyWithPhotos != true;
+            return filter;
+        }
+    }
+
+    vector<QueryPlan> compileQueryPlans(
+        const vector<KufarConfiguration> &configurations,
+        int defaultIntervalSeconds,
+        int defaultMaxPages,
+        bool coalesce,
+        int coalescedMaxPages) {
+        vector<KufarConfiguration> canonical(configurations);
+        vector<string> exactURLs;
+        // Groups of configurations served by one request, in order of
+        // their first member.
+        vector<vector<size_t>> groups;
+        unordered_map<string, size_t> groupByKey;
+
+        for (size_t i = 0; i < canonical.size(); i++) {
+            // "ar" is an OR over areas, so their order must not change the key.
+            if (canonical[i].areas.has_value()) {
+                vector<int> &areas = canonical[i].areas.value();
+                sort(areas.begin(), areas.end());
+                areas.erase(unique(areas.begin(), areas.end()), areas.end());
+            }
+            exactURLs.push_back(getSearchURL(canonical[i]));
+
+            // A price-sorted page holds the cheapest ads of the broad
+            // request, which need not include those of a member.
+            string key = coalesce && isSortedByListTime(canonical[i])
+                ? coalescingKey(canonical[i]) : exactURLs[i];
+            auto existing = groupByKey.find(key);
+            if (existing == groupByKey.end()) {
+                groupByKey.emplace(key, groups.size());
+                groups.push_back({i});
+            } else {
+                groups[existing->second].push_back(i);
+            }
+        }
+
+        vector<QueryPlan> plans;
+        for (const vector<size_t> &group : groups) {
+            vector<const KufarConfiguration *> members;
+            for (size_t i : group) {
+                members.push_back(&canonical[i]);
+            }
+            KufarConfiguration broad = broaden(members);
+            const KufarConfiguration &first = canonical[group.front()];
+
+            QueryPlan plan;
+            plan.url = getSearchURL(broad);
+            plan.hash = fnv1a64(plan.url);
+            plan.label = first.tag.value_or("(no tag)");
+            plan.configuration = group.front();
+            plan.intervalSeconds = defaultIntervalSeconds;
+            plan.jitterSeconds = first.jitterSeconds.value_or(0);
+            plan.maxPages = 1;
+            for (size_t i : group) {
+                const KufarConfiguration &member = canonical[i];
+                plan.members.push_back({i, localFilter(member, broad)});
+                int interval = member.intervalSeconds.value_or(defaultIntervalSeconds);
+                plan.intervalSeconds = i == group.front()
+                    ? interval : min(plan.intervalSeconds, interval);
+                plan.maxPages = max(plan.maxPages,
+                                    member.maxPages.value_or(defaultMaxPages));
+
+                if (i == group.front()) {
+                    continue;
+                }
+                if (exactURLs[i] == exactURLs[group.front()]) {
+                    Log::info("Query " + to_string(i) + " tag=" +
+                              member.tag.value_or("(no tag)") +
+                              " duplicates query " + to_string(group.front()) +
+                              ", polling it once");
+                } else {
+                    Log::info("Query " + to_string(i) + " tag=" +
+                              member.tag.value_or("(no tag)") +
+                              " coalesced into query " + to_string(group.front()) +
+                              ", filtering it locally");
+                }
+            }
+            // A burst of ads other members do not want can push a member's
+            // new ads off the first page of the broad request; follow-ups
+            // still stop at the first page that reaches the previous poll.
+            if (plan.filtersLocally()) {
+                plan.maxPages = max(plan.maxPages, coalescedMaxPages);
+            }
+            plans.push_back(std::move(plan));
+        }
+        return plans;
+    }
+
+    string getPageURL(const QueryPlan &plan, const string &token) {
+        // Search URLs end in '?' or '&', ready for one more parameter.
+        return plan.url + "cursor=" + urlEncode(token);
+    }
+
+    namespace {
+        // Event-driven extractor for the rendered-paginated response. It
+        // builds Ad records directly from SAX events and ignores every
+        // subtree it does not need instead of materializing a DOM.
+        //
+        // Depth layout of the fields we read:
+        //   1 {  "ads", "pagination"
+        //   2 [  ads array                  {  pagination: "pages"
+        //   3 {  ad: subject, ad_id, ...    [  pages array
+        //   4 [  account_parameters / ...   {  label, num, token
+        //   5 {  p, v / id, path, yams_storage
+        class AdsSaxHandler : public nlohmann::json_sax<json> {
+        public:
+            AdsSaxHandler(const KufarConfiguration &configuration,
+                          vector<Ad> &adverts,
+                          Pagination *pagination,
+                          optional<time_t> stopBefore)
+                : configuration(configuration), adverts(adverts),
+                  pagination(pagination), stopBefore(stopBefore) {}
+
+            bool foundAds() const { return sawAds; }
+            bool stoppedEarly() const { return stopped; }
+
+            bool null() override { return value(Value()); }
+
+            bool boolean(bool val) override {
+                Value v;
+                v.type = Value::Type::boolean;
+                v.boolean = val;
+                return value(v);
+            }
+
+            bool number_integer(number_integer_t val) override {
+                Value v;
+                v.type = Value::Type::integer;
+                v.integer = val;
+                return value(v);
+            }
+
+            bool number_unsigned(number_unsigned_t val) override {
+                return number_integer(static_cast<number_integer_t>(val));
+            }
+
+            bool number_float(number_float_t, const string_t &) override {
+                return value(Value());
+            }
+
+            bool string(string_t &val) override {
+                Value v;
+                v.type = Value::Type::text;
+                v.text = std::move(val);
+                return value(v);
+            }
+
+            bool binary(binary_t &) override { return value(Value()); }
+
+            bool start_object(std::size_t) override {
+                depth++;
+                if (depth == 3 && inAds) {
+                    current = Ad();
+                    if (configuration.tag.has_value()) {
+                        current.tag = configuration.tag.value();
+                    }
+                    requiredFields = 0;
+                    sellerNameFound = false;
+                } else if (depth == 5 && section != Section::none) {
+                    item = Item();
+                } else if (depth == 2 && rootKey == RootKey::pagination) {
+                    inPagination = true;
+                } else if (depth == 4 && inPages) {
+                    item = Item();
+                }
+                return true;
+            }
+
+            bool end_object() override {
+                if (depth == 3 && inAds) {
+                    finishAd();
+                    if (stopped) {
+                        // Returning false ends sax_parse() right here.
+                        return false;
+                    }
+                } else if (depth == 5 && section != Section::none) {
+                    finishItem();
+                } else if (depth == 2) {
+                    inPagination = false;
+                } else if (depth == 4 && inPages) {
+                    finishPage();
+                }
+                depth--;
+                return true;
+            }
+
+            bool start_array(std::size_t) override {
+                depth++;
+                if (depth == 2 && rootKey == RootKey::ads) {
+                    inAds = true;
+                    sawAds = true;
+                } else if (depth == 3 && inPagination && paginationKeyIsPages) {
+                    inPages = pagination != nullptr;
+                } else if (depth == 4 && inAds) {
+                    switch (adKey) {
+                        case AdKey::accountParameters:
+                            section = Section::accountParameters;
+                            requiredFields |= FIELD_ACCOUNT_PARAMETERS;
+                            break;
+                        case AdKey::adParameters:
+                            section = Section::adParameters;
+                            break;
+                        case AdKey::images:
+                            section = Section::images;
+                            requiredFields |= FIELD_IMAGES;
+                            break;
+                        default:
+                            break;
+                    }
+                }
+                return true;
+            }
+
+            bool end_array() override {
+                if (depth == 2) {
+                    inAds = false;
+                } else if (depth == 3) {
+                    inPages = false;
+                } else if (depth == 4) {
+                    section = Section::none;
+                }
+                depth--;
+                return true;
+            }
+
+            bool key(string_t &val) override {
+                if (depth == 1) {
+                    rootKey = (val == "ads") ? RootKey::ads
+                        : (val == "pagination") ? RootKey::pagination
+                        : RootKey::other;
+                } else if (depth == 2 && inPagination) {
+                    paginationKeyIsPages = (val == "pages");
+                } else if (depth == 4 && inPages) {
+                    itemKey = itemKeyFromString(val);
+                } else if (depth == 3 && inAds) {
+                    adKey = adKeyFromString(val);
+                } else if (depth == 5 && section != Section::none) {
+                    itemKey = itemKeyFromString(val);
+                }
+                return true;
+            }
+
+            bool parse_error(std::size_t, const std::string &,
+                             const nlohmann::detail::exception &ex) override {
+                throw std::runtime_error(ex.what());
+            }
+
+        private:
+            enum class RootKey { other, ads, pagination };
+            enum class AdKey {
+                other, subject, adId, listTime, priceByn, phoneHidden,
+                adLink, accountParameters, adParameters, images, companyAd
+            };
+            enum class ItemKey {
+                other, p, v, id, path, yamsStorage, label, num, token
+            };
+            enum class Section {
+                none, accountParameters, adParameters, images
+            };
+
+            static constexpr unsigned FIELD_SUBJECT = 1 << 0;
+            static constexpr unsigned FIELD_AD_ID = 1 << 1;
+            static constexpr unsigned FIELD_LIST_TIME = 1 << 2;
+            static constexpr unsigned FIELD_PRICE = 1 << 3;
+            static constexpr unsigned FIELD_PHONE_HIDDEN = 1 << 4;
+            static constexpr unsigned FIELD_AD_LINK = 1 << 5;
+            static constexpr unsigned FIELD_ACCOUNT_PARAMETERS = 1 << 6;
+            static constexpr unsigned FIELD_IMAGES = 1 << 7;
+            static constexpr unsigned FIELDS_REQUIRED = (1 << 8) - 1;
+
+            struct Value {
+                enum class Type { none, boolean, integer, text };
+                Type type = Type::none;
+                bool boolean = false;
+                int64_t integer = 0;
+                std::string text;
+            };
+
+            // Fields of one element of account_parameters, ad_parameters,
+            // images or pagination pages. Keys may come in any order, so
+            // they are buffered until the element's object closes.
+            struct Item {
+                Value p;
+                Value v;
+                Value id;
+                Value path;
+                Value yamsStorage;
+                Value label;
+                Value num;
+                Value token;
+            };
+
+            static AdKey adKeyFromString(const std::string &key) {
+                if (key == "subject") return AdKey::subject;
+                if (key == "ad_id") return AdKey::adId;
+                if (key == "list_time") return AdKey::listTime;
+                if (key == "price_byn") return AdKey::priceByn;
+                if (key == "phone_hidden") return AdKey::phoneHidden;
+                if (key == "ad_link") return AdKey::adLink;
+                if (key == "account_parameters") return AdKey::accountParameters;
+                if (key == "ad_parameters") return AdKey::adParameters;
+                if (key == "images") return AdKey::images;
+                if (key == "company_ad") return AdKey::companyAd;
+                return AdKey::other;
+            }
+
+            static ItemKey itemKeyFromString(const std::string &key) {
+                if (key == "p") return ItemKey::p;
+                if (key == "v") return ItemKey::v;
+                if (key == "id") return ItemKey::id;
+                if (key == "path") return ItemKey::path;
+                if (key == "yams_storage") return ItemKey::yamsStorage;
+                if (key == "label") return ItemKey::label;
+                if (key == "num") return ItemKey::num;
+                if (key == "token") return ItemKey::token;
+                return ItemKey::other;
+            }
+
+            // Ad parameter values come as numbers or as numeric strings.
+            static optional<int> integerParameter(const Value &v) {
+                if (v.type == Value::Type::integer) {
+                    return static_cast<int>(v.integer);
+                }
+                if (v.type == Value::Type::text) {
                     try {
-                        if (param.at("p") == "region") {
-                            // region value is numeric
-                            advert.region =
-                                static_cast<Region>(
-                                    param.at("v").get<int>());
+                        return stoi(v.text);
+                    } catch (...) {}
+                }
+                return nullopt;
+            }
+
+            static std::string &expectText(Value &v, const char *field) {
+                if (v.type != Value::Type::text) {
+                    throw std::runtime_error(
+                        std::string("unexpected type of \"") + field + "\"");
+                }
+                return v.text;
+            }
+
+            bool value(Value &v) {
+                if (depth == 3 && inAds) {
+                    setAdField(v);
+                } else if ((depth == 5 && section != Section::none) ||
+                           (depth == 4 && inPages)) {
+                    switch (itemKey) {
+                        case ItemKey::p: item.p = std::move(v); break;
+                        case ItemKey::v: item.v = std::move(v); break;
+                        case ItemKey::id: item.id = std::move(v); break;
+                        case ItemKey::path: item.path = std::move(v); break;
+                        case ItemKey::yamsStorage:
+                            item.yamsStorage = std::move(v);
+                            break;
+                        case ItemKey::label: item.label = std::move(v); break;
+                        case ItemKey::num: item.num = std::move(v); break;
+                        case ItemKey::token: item.token = std::move(v); break;
+                        default: break;
+                    }
+                }
+                return true;
+            }
+
+            bool value(Value &&v) { return value(v); }
+
+            void setAdField(Value &v) {
+                switch (adKey) {
+                    case AdKey::subject:
+                        current.title = std::move(expectText(v, "subject"));
+                        requiredFields |= FIELD_SUBJECT;
+                        break;
+                    case AdKey::adId:
+                        if (v.type != Value::Type::integer) {
+                            throw std::runtime_error("unexpected type of \"ad_id\"");
                         }
-                        else if (param.at("p") == "area") {
-                            // area value may be a string or number
-                            if (param.at("v").is_number_integer()) {
-                                advert.area = param.at("v").get<int>();
-                            } else if (param.at("v").is_string()) {
-                                advert.area = stoi(param.at("v").get<string>());
+                        current.id = static_cast<int>(v.integer);
+                        requiredFields |= FIELD_AD_ID;
+                        break;
+                    case AdKey::listTime:
+                        current.date = zuluToTimestamp(expectText(v, "list_time"));
+                        requiredFields |= FIELD_LIST_TIME;
+                        break;
+                    case AdKey::priceByn:
+                        current.price = stoi(expectText(v, "price_byn"));
+                        requiredFields |= FIELD_PRICE;
+                        break;
+                    case AdKey::phoneHidden:
+                        if (v.type != Value::Type::boolean) {
+                            throw std::runtime_error("unexpected type of \"phone_hidden\"");
+                        }
+                        current.phoneNumberIsVisible = !v.boolean;
+                        requiredFields |= FIELD_PHONE_HIDDEN;
+                        break;
+                    case AdKey::adLink:
+                        current.link = std::move(expectText(v, "ad_link"));
+                        requiredFields |= FIELD_AD_LINK;
+                        break;
+                    case AdKey::companyAd:
+                        // Optional, like the ad parameters below.
+                        current.companyAd =
+                            v.type == Value::Type::boolean && v.boolean;
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            void finishItem() {
+                switch (section) {
+                    case Section::accountParameters:
+                        if (!sellerNameFound &&
+                            item.p.type == Value::Type::text &&
+                            item.p.text == "name") {
+                            current.sellerName =
+                                std::move(expectText(item.v, "v"));
+                            sellerNameFound = true;
+                        }
+                        break;
+                    case Section::adParameters:
+                        // Optional fields; values of unexpected types are
+                        // ignored.
+                        if (item.p.type != Value::Type::text) break;
+                        if (item.p.text == "region" &&
+                            item.v.type == Value::Type::integer) {
+                            current.region =
+                                static_cast<Region>(item.v.integer);
+                        } else if (item.p.text == "area") {
+                            current.area = integerParameter(item.v);
+                        } else if (item.p.text == "condition") {
+                            optional<int> condition = integerParameter(item.v);
+                            if (condition == int(ItemCondition::used) ||
+                                condition == int(ItemCondition::_new)) {
+                                current.condition =
+                                    static_cast<ItemCondition>(condition.value());
                             }
                         }
-                    } catch (...) {
-                        // ignore parsing errors for optional fields
-                    }
+                        break;
+                    case Section::images:
+                        if (item.yamsStorage.type != Value::Type::boolean) {
+                            throw std::runtime_error("unexpected type of \"yams_storage\"");
+                        }
+                        insertImageURL(current.images,
+                                       expectText(item.id, "id"),
+                                       expectText(item.path, "path"),
+                                       item.yamsStorage.boolean);
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            // Entries without a token (the "self" page) are skipped.
+            void finishPage() {
+                if (item.token.type != Value::Type::text ||
+                    item.label.type != Value::Type::text) {
+                    return;
+                }
+                if (item.label.text == "next") {
+                    pagination->next = item.token.text;
+                } else if (item.label.text == "page" &&
+                           item.num.type == Value::Type::integer) {
+                    PageToken page;
+                    page.number = static_cast<int>(item.num.integer);
+                    page.token = std::move(item.token.text);
+                    pagination->pages.push_back(std::move(page));
                 }
             }
 
-            json imagesArray = ad.at("images");
-            for (const auto &image : imagesArray) {
-                string imageID = image.at("id");
-                string path = image.at("path");
-                bool isYams = image.at("yams_storage");
-                insertImageURL(advert.images, imageID, path, isYams);
+            void finishAd() {
+                if ((requiredFields & FIELDS_REQUIRED) != FIELDS_REQUIRED) {
+                    throw std::runtime_error(
+                        "ad is missing required fields (mask=" +
+                        std::to_string(requiredFields) + ")");
+                }
+                if (stopBefore.has_value() && current.date < stopBefore.value()) {
+                    stopped = ++oldAdsInRow >= STOP_AFTER_OLD_ADS;
+                } else {
+                    oldAdsInRow = 0;
+                }
+                adverts.push_back(std::move(current));
             }
-            adverts.push_back(advert);
+
+            const KufarConfiguration &configuration;
+            vector<Ad> &adverts;
+            Pagination *pagination;
+            optional<time_t> stopBefore;
+            int oldAdsInRow = 0;
+            bool stopped = false;
+
+            int depth = 0;
+            bool inAds = false;
+            bool sawAds = false;
+            bool inPagination = false;
+            bool paginationKeyIsPages = false;
+            bool inPages = false;
+            RootKey rootKey = RootKey::other;
+            AdKey adKey = AdKey::other;
+            ItemKey itemKey = ItemKey::other;
+            Section section = Section::none;
+
+            Ad current;
+            Item item;
+            unsigned requiredFields = 0;
+            bool sellerNameFound = false;
+        };
+    }
+
+    bool isSortedByListTime(const KufarConfiguration &configuration) {
+        // Both explicit sort types order by price.
+        return !configuration.sortType.has_value();
+    }
+
+    vector<Ad> parseAds(const KufarConfiguration &configuration,
+                        const string &rawJson,
+                        ParseOptions *options) {
+        Tracing::Span span("parseAds", "parse");
+        span.arg("tag", configuration.tag.value_or(""));
+        span.arg("bytes", static_cast<int64_t>(rawJson.size()));
+        vector<Ad> adverts;
+        AdsSaxHandler handler(configuration, adverts,
+                              options ? options->pagination : nullptr,
+                              options ? options->stopBefore : nullopt);
+        try {
+            json::sax_parse(rawJson, &handler);
+            if (!handler.foundAds()) {
+                throw runtime_error("response has no \"ads\" array");
+            }
+            if (options != nullptr) {
+                options->stoppedEarly = handler.stoppedEarly();
+            }
+        } catch (const std::exception &e) {
+            Log::error("getAds: JSON parse failed: " + string(e.what()) +
+                       " (response length=" + to_string(rawJson.size()) + ")");
+            throw;
         }
+        span.arg("ads", static_cast<int64_t>(adverts.size()));
         return adverts;
     }
 
+    vector<Ad> getAds(const KufarConfiguration &configuration) {
+        return parseAds(configuration,
+                        getJSONFromURL(getSearchURL(configuration)));
+    }
+
     namespace EnumString {
         string sortType(SortType sortType) {
             switch (sortType) {
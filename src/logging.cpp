@@ -1,57 +1,229 @@
-#include "logging.hpp"
-#include <fstream>
-#include <iostream>
-#include <mutex>
-#include <sstream>
-#include <iomanip>
-#include <ctime>
-
-namespace Log {
-
-namespace {
-    std::ofstream g_logFile;
-    bool g_initialized = false;
-    std::mutex g_mutex;
-
-    std::string timestamp() {
-        std::time_t t = std::time(nullptr);
-        std::tm *tm = std::gmtime(&t);
-        if (!tm) return "[?]";
-        std::ostringstream oss;
-        oss << std::put_time(tm, "%Y-%m-%dT%H:%M:%SZ");
-        return oss.str();
-    }
-
-    void write(const std::string &level, const std::string &msg) {
-        std::lock_guard<std::mutex> lock(g_mutex);
-        if (!g_initialized || !g_logFile.is_open()) return;
-        g_logFile << "[" << timestamp() << "] " << level << ": " << msg << "\n";
-        g_logFile.flush();
-    }
-}
-
-bool init(const std::string &filePath) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    if (g_logFile.is_open()) g_logFile.close();
-    g_logFile.open(filePath, std::ios::out | std::ios::app);
-    g_initialized = g_logFile.is_open();
-    return g_initialized;
-}
-
-bool isInitialized() {
-    return g_initialized;
-}
-
-void info(const std::string &msg) {
-    write("INFO", msg);
-}
-
-void warn(const std::string &msg) {
-    write("WARN", msg);
-}
-
-void error(const std::string &msg) {
-    write("ERROR", msg);
-}
-
-} // namespace Log
+#include "logging.hpp"
+#include "ringbuffer.hpp"
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <memory>
+#include <cstdlib>
+#include <ctime>
+#include <condition_variable>
+
+namespace Log {
+
+namespace detail {
+    std::atomic<int> minimumLevel{static_cast<int>(Level::info)};
+}
+
+namespace {
+    using Clock = std::chrono::system_clock;
+
+    const size_t BUFFER_CAPACITY = 16384;
+    // Longest a queued record waits before it reaches the file.
+    const std::chrono::milliseconds FLUSH_INTERVAL{100};
+    // Fill level at which a producer wakes the writer before the interval
+    // ends, so bursts are written out before the buffer overflows.
+    const size_t HIGH_WATER_MARK = BUFFER_CAPACITY / 2;
+
+    struct Record {
+        Level level = Level::info;
+        Clock::time_point time;
+        std::string message;
+    };
+
+    const char *levelName(Level level) {
+        switch (level) {
+            case Level::debug: return "DEBUG";
+            case Level::info: return "INFO";
+            case Level::warn: return "WARN";
+            case Level::error: return "ERROR";
+        }
+        return "?";
+    }
+
+    // init() and shutdown() only; the hot path never takes it.
+    std::mutex g_lifecycleMutex;
+    std::atomic<bool> g_initialized{false};
+    std::unique_ptr<RingBuffer<Record>> g_buffer;
+    std::FILE *g_file = nullptr;
+    std::thread g_writer;
+    std::atomic<uint64_t> g_written{0};
+    std::atomic<uint64_t> g_dropped{0};
+    // The writer sleeps here rather than parking in the ring buffer, so a
+    // push never finds a waiting consumer to lock for and notify.
+    std::mutex g_wakeMutex;
+    std::condition_variable g_wake;
+    std::atomic<bool> g_wakeRequested{false};
+
+    class Formatter {
+    public:
+        // Appends "[2024-05-01T10:00:00Z] LEVEL: message\n" to out; the
+        // time prefix is rebuilt only when the second changes.
+        void append(const Record &record, std::string &out) {
+            std::time_t seconds = Clock::to_time_t(record.time);
+            if (seconds != cachedSecond || prefix.empty()) {
+                std::tm tm;
+                char text[32];
+                if (gmtime_r(&seconds, &tm) &&
+                    std::strftime(text, sizeof(text), "[%Y-%m-%dT%H:%M:%SZ] ", &tm)) {
+                    prefix = text;
+                } else {
+                    prefix = "[?] ";
+                }
+                cachedSecond = seconds;
+            }
+            out += prefix;
+            out += levelName(record.level);
+            out += ": ";
+            out += record.message;
+            out += '\n';
+        }
+
+    private:
+        std::time_t cachedSecond = 0;
+        std::string prefix;
+    };
+
+    void writeBatch(const std::string &batch) {
+        if (!batch.empty()) {
+            std::fwrite(batch.data(), 1, batch.size(), g_file);
+            std::fflush(g_file);
+        }
+    }
+
+    void runWriter(RingBuffer<Record> *buffer) {
+        Formatter formatter;
+        std::string batch;
+        uint64_t reportedDrops = 0;
+        while (true) {
+            // Checked before draining so records pushed before close()
+            // are still written by this last pass.
+            bool closing = buffer->isClosed();
+            std::optional<Record> record = buffer->tryPop();
+            batch.clear();
+            size_t count = 0;
+            while (record.has_value()) {
+                formatter.append(record.value(), batch);
+                count++;
+                record = buffer->tryPop();
+            }
+
+            uint64_t drops = g_dropped.load(std::memory_order_relaxed);
+            if (drops != reportedDrops) {
+                Record notice;
+                notice.level = Level::warn;
+                notice.time = Clock::now();
+                notice.message = "Log buffer full, " +
+                    std::to_string(drops - reportedDrops) + " records dropped";
+                formatter.append(notice, batch);
+                reportedDrops = drops;
+            }
+            writeBatch(batch);
+            g_written.fetch_add(count, std::memory_order_relaxed);
+            if (closing) {
+                break;
+            }
+
+            std::unique_lock<std::mutex> lock(g_wakeMutex);
+            g_wake.wait_for(lock, FLUSH_INTERVAL, [buffer] {
+                return g_wakeRequested.load(std::memory_order_relaxed) ||
+                       buffer->isClosed();
+            });
+            g_wakeRequested.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void wakeWriter() {
+        std::lock_guard<std::mutex> lock(g_wakeMutex);
+        g_wakeRequested.store(true, std::memory_order_relaxed);
+        g_wake.notify_one();
+    }
+
+    void enqueue(Level level, std::string &&msg) {
+        if (!enabled(level) || !g_initialized.load(std::memory_order_acquire)) {
+            return;
+        }
+        Record record;
+        record.level = level;
+        record.time = Clock::now();
+        record.message = std::move(msg);
+        if (!g_buffer->tryPush(record)) {
+            g_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (g_buffer->size() >= HIGH_WATER_MARK &&
+            !g_wakeRequested.load(std::memory_order_relaxed)) {
+            wakeWriter();
+        }
+    }
+
+    void stopWriter() {
+        g_initialized.store(false, std::memory_order_release);
+        if (g_buffer) {
+            g_buffer->close();
+            wakeWriter();
+        }
+        if (g_writer.joinable()) {
+            g_writer.join();
+        }
+        if (g_file) {
+            std::fclose(g_file);
+            g_file = nullptr;
+        }
+    }
+}
+
+bool init(const std::string &filePath) {
+    std::lock_guard<std::mutex> lock(g_lifecycleMutex);
+    stopWriter();
+    g_file = std::fopen(filePath.c_str(), "a");
+    if (!g_file) {
+        return false;
+    }
+    static bool registered = false;
+    if (!registered) {
+        std::atexit(shutdown);
+        registered = true;
+    }
+    g_buffer = std::make_unique<RingBuffer<Record>>(BUFFER_CAPACITY);
+    g_writer = std::thread(runWriter, g_buffer.get());
+    g_initialized.store(true, std::memory_order_release);
+    return true;
+}
+
+void shutdown() {
+    std::lock_guard<std::mutex> lock(g_lifecycleMutex);
+    stopWriter();
+}
+
+void setLevel(Level level) {
+    detail::minimumLevel.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+bool isInitialized() {
+    return g_initialized.load(std::memory_order_acquire);
+}
+
+Stats stats() {
+    Stats result;
+    result.written = g_written.load(std::memory_order_relaxed);
+    result.dropped = g_dropped.load(std::memory_order_relaxed);
+    return result;
+}
+
+void debug(std::string msg) {
+    enqueue(Level::debug, std::move(msg));
+}
+
+void info(std::string msg) {
+    enqueue(Level::info, std::move(msg));
+}
+
+void warn(std::string msg) {
+    enqueue(Level::warn, std::move(msg));
+}
+
+void error(std::string msg) {
+    enqueue(Level::error, std::move(msg));
+}
+
+} // namespace Log
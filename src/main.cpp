@@ -1,8 +1,13 @@
+#include <cstdio>
 #include <iostream>
 #include <unistd.h>
 #include <signal.h>
 #include <fstream>
 #include <vector>
+#include <chrono>
+#include <thread>
+#include <numeric>
+#include <algorithm>
 #include <curl/curl.h>
 
 #include <nlohmann/json.hpp>
@@ -11,6 +16,13 @@
 #include "networking.hpp"
 #include "helperfunctions.hpp"
 #include "logging.hpp"
+#include "seenadstore.hpp"
+#include "cachejournal.hpp"
+#include "scheduler.hpp"
+#include "pipeline.hpp"
+#include "tenant.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
 
 using namespace std;
 using namespace Kufar;
@@ -19,6 +31,9 @@ using nlohmann::json;
 
 const string CACHE_FILE_NAME = "cached-data.json";
 const string CONFIGURATION_FILE_NAME = "kufar-configuration.json";
+const chrono::seconds STATS_REPORT_INTERVAL{60};
+// Tenant of the top-level "telegram" and "queries".
+const string DEFAULT_TENANT_NAME = "default";
 
 struct ConfigurationFile {
     string path;
@@ -27,131 +42,390 @@ struct ConfigurationFile {
 
 struct CacheFile {
     string path;
-    json contents;
 };
 
 struct Files {
     ConfigurationFile configuration;
     CacheFile cache;
     string logPath;
+    // Rewrite the cache in the binary format and exit.
+    bool convertCache = false;
+    // Record every ad of every query without notifying, then exit.
+    bool backfill = false;
+    // Record trace spans and write them here on SIGUSR1 and at exit.
+    string tracePath;
+};
+
+struct AdaptiveSchedule {
+    bool enabled = false;
+    // Global budget shared by all queries.
+    double requestsPerMinute = 60;
+    int minIntervalSeconds = 10;
+    int maxIntervalSeconds = 3600;
+};
+
+struct TenantConfiguration {
+    string name;
+    vector<TelegramConfiguration> chats;
+    string cachePath;
 };
 
 struct ProgramConfiguration {
+    // Queries of every tenant, and the tenant each one belongs to.
     vector<KufarConfiguration> kufarConfiguration;
+    vector<size_t> tenantOfQuery;
+    // Bot and message settings that tenants inherit.
     TelegramConfiguration telegramConfiguration;
+    vector<TenantConfiguration> tenants;
     Files files;
 
-    int queryDelaySeconds = 5;
+    // Default polling interval of queries without their own "interval".
     int loopDelaySeconds = 30;
+    // Default page depth of queries without their own "max-pages".
+    int maxPages = 1;
+    // Queries fetched concurrently; replaces the old per-query delay.
+    unsigned int maxRequestsInFlight = 8;
+    // Adverts waiting for the Telegram sender before the scan blocks.
+    size_t notificationQueueCapacity = 1000;
+    // Replaces per-query intervals with a budget split by arrival rate.
+    AdaptiveSchedule adaptiveSchedule;
+    PipelineOptions pipeline;
+    // Stop parsing newest-first responses behind each query's newest ad.
+    bool useWatermarks = true;
+    // Share one request between queries that differ only in filters that
+    // can be checked on the parsed ads. Off by default: a member then sees
+    // only the pages the broad request reads, see coalescedMaxPages.
+    bool coalesceQueries = false;
+    // Page depth of coalesced requests, so a burst of ads other members
+    // filter out does not hide a member's new ads beyond the first page.
+    int coalescedMaxPages = 5;
+    // Prometheus endpoint and/or file; both off by default.
+    Metrics::ExporterOptions metrics;
 };
 
+string tenantCachePath(const string &defaultPath, const string &name) {
+    const string extension = ".json";
+    if (defaultPath.size() > extension.size() &&
+        defaultPath.compare(defaultPath.size() - extension.size(),
+                            extension.size(), extension) == 0) {
+        return defaultPath.substr(0, defaultPath.size() - extension.size()) +
+               "." + name + extension;
+    }
+    return defaultPath + "." + name;
+}
+
+// A "telegram" object on top of base: tenants inherit the top-level bot and
+// settings and may override them.
+TelegramConfiguration readTelegramConfiguration(const json &telegramData,
+                                                TelegramConfiguration base) {
+    base.botToken = getOptionalValue<string>(telegramData, "bot-token")
+        .value_or(base.botToken);
+    base.apiURL = getOptionalValue<string>(telegramData, "api-url")
+        .value_or(base.apiURL);
+    base.utcOffsetMinutes =
+        getOptionalValue<int>(telegramData, "utc-offset-minutes")
+            .value_or(base.utcOffsetMinutes);
+    return base;
+}
+
+// One destination per "chat-id" and "chat-ids" entry.
+vector<TelegramConfiguration> readChats(const json &telegramData,
+                                        const TelegramConfiguration &bot) {
+    vector<int64_t> chatIDs;
+    if (telegramData.contains("chat-id")) {
+        chatIDs.push_back(telegramData.at("chat-id").get<int64_t>());
+    }
+    if (telegramData.contains("chat-ids")) {
+        for (const json &chatID : telegramData.at("chat-ids")) {
+            chatIDs.push_back(chatID.get<int64_t>());
+        }
+    }
+    vector<TelegramConfiguration> chats;
+    for (int64_t chatID : chatIDs) {
+        TelegramConfiguration chat = bot;
+        chat.chatID = chatID;
+        chats.push_back(chat);
+    }
+    return chats;
+}
+
+void loadQueries(const json &queriesData,
+                 size_t tenant,
+                 ProgramConfiguration &programConfiguration) {
+    for (const json &query : queriesData) {
+        KufarConfiguration kufarConfiguration;
+
+        kufarConfiguration.onlyTitleSearch =
+            getOptionalValue<bool>(
+                query, "only-title-search");
+        kufarConfiguration.tag = getOptionalValue<string>(query, "tag");
+        if (query.contains("price")) {
+            json queryPriceData = query.at("price");
+            kufarConfiguration.priceRange.priceMin =
+                getOptionalValue<int>(
+                    queryPriceData, "min");
+            kufarConfiguration.priceRange.priceMax =
+                getOptionalValue<int>(
+                    queryPriceData, "max");
+        }
+
+        kufarConfiguration.language =
+            getOptionalValue<string>(
+                query, "language");
+        kufarConfiguration.limit = getOptionalValue<int>(query, "limit");
+        kufarConfiguration.currency =
+            getOptionalValue<string>(
+                query, "currency");
+        kufarConfiguration.condition =
+            getOptionalValue<ItemCondition>(
+                query, "condition");
+        kufarConfiguration.sellerType =
+            getOptionalValue<SellerType>(
+                query, "seller-type");
+        kufarConfiguration.kufarDeliveryRequired =
+            getOptionalValue<bool>(
+                query, "kufar-delivery-required");
+        kufarConfiguration.kufarPaymentRequired =
+            getOptionalValue<bool>(
+                query, "kufar-payment-required");
+        kufarConfiguration.kufarHalvaRequired =
+            getOptionalValue<bool>(
+                query, "kufar-halva-required");
+        kufarConfiguration.onlyWithPhotos =
+            getOptionalValue<bool>(
+                query, "only-with-photos");
+        kufarConfiguration.onlyWithVideos =
+            getOptionalValue<bool>(
+                query, "only-with-videos");
+        kufarConfiguration.onlyWithExchangeAvailable =
+            getOptionalValue<bool>(
+                query, "only-with-exchange-available");
+        kufarConfiguration.sortType =
+            getOptionalValue<SortType>(
+                query, "sort-type");
+        kufarConfiguration.category =
+            getOptionalValue<Category>(
+                query, "category");
+        kufarConfiguration.subCategory =
+            getOptionalValue<int>(
+                query, "sub-category");
+        kufarConfiguration.region =
+            getOptionalValue<Region>(
+                query, "region");
+        kufarConfiguration.areas =
+            getOptionalValue<vector<int>>(query, "areas");
+        kufarConfiguration.intervalSeconds =
+            getOptionalValue<int>(query, "interval");
+        kufarConfiguration.jitterSeconds =
+            getOptionalValue<int>(query, "jitter");
+        kufarConfiguration.maxPages =
+            getOptionalValue<int>(query, "max-pages");
+        programConfiguration.kufarConfiguration
+            .push_back(kufarConfiguration);
+        programConfiguration.tenantOfQuery.push_back(tenant);
+    }
+}
+
+void addTenant(const string &name,
+               const json &telegramData,
+               const json &queriesData,
+               const string &cachePath,
+               ProgramConfiguration &programConfiguration) {
+    // The name becomes part of the default cache file name.
+    if (name.empty() || name.find('/') != string::npos ||
+        name.find('\\') != string::npos) {
+        Log::error("Tenant name must be non-empty and contain no path separators: \"" +
+                   name + "\"");
+        exit(1);
+    }
+    TenantConfiguration tenant;
+    tenant.name = name;
+    tenant.cachePath = cachePath;
+    TelegramConfiguration bot = readTelegramConfiguration(
+        telegramData, programConfiguration.telegramConfiguration);
+    tenant.chats = readChats(telegramData, bot);
+    if (tenant.chats.empty() || bot.botToken.empty()) {
+        Log::error("Tenant " + name + " needs a bot-token and a chat-id");
+        exit(1);
+    }
+    for (const TenantConfiguration &existing : programConfiguration.tenants) {
+        if (existing.name == name) {
+            Log::error("Duplicate tenant name: " + name);
+            exit(1);
+        }
+        if (existing.cachePath == cachePath) {
+            Log::error("Tenants " + existing.name + " and " + name +
+                       " share the cache " + cachePath);
+            exit(1);
+        }
+    }
+    loadQueries(queriesData, programConfiguration.tenants.size(),
+                programConfiguration);
+    programConfiguration.tenants.push_back(tenant);
+}
+
 void loadJSONConfigurationData(
     const json &data,
     ProgramConfiguration &programConfiguration) {
     {
-        json telegramData = data.at("telegram");
-        auto botToken =
-            telegramData.at("bot-token");
-        programConfiguration.telegramConfiguration
-            .botToken = botToken;
-        auto chatId = telegramData.at("chat-id");
-        programConfiguration.telegramConfiguration.chatID =
-            chatId;
-    }
-    {
-        json queriesData = data.at("queries");
-
-        unsigned int index = 0;
-        for (const json &query : queriesData) {
-            KufarConfiguration kufarConfiguration;
-
-            kufarConfiguration.onlyTitleSearch =
-                getOptionalValue<bool>(
-                    query, "only-title-search");
-            kufarConfiguration.tag = getOptionalValue<string>(query, "tag");
-            if (query.contains("price")) {
-                json queryPriceData = query.at("price");
-                kufarConfiguration.priceRange.priceMin =
-                    getOptionalValue<int>(
-                        queryPriceData, "min");
-                kufarConfiguration.priceRange.priceMax =
-                    getOptionalValue<int>(
-                        queryPriceData, "max");
+        // Without "tenants" the top-level telegram and queries are the only
+        // tenant, as before; with them they are optional.
+        bool multiTenant = data.contains("tenants");
+        json telegramData = multiTenant && !data.contains("telegram")
+            ? json::object() : data.at("telegram");
+        programConfiguration.telegramConfiguration = readTelegramConfiguration(
+            telegramData, programConfiguration.telegramConfiguration);
+        programConfiguration.notificationQueueCapacity =
+            getOptionalValue<size_t>(telegramData, "queue-capacity")
+                .value_or(programConfiguration.notificationQueueCapacity);
+
+        if (!multiTenant || data.contains("queries")) {
+            addTenant(DEFAULT_TENANT_NAME, telegramData, data.at("queries"),
+                      programConfiguration.files.cache.path,
+                      programConfiguration);
+        }
+        if (multiTenant) {
+            for (const json &tenantData : data.at("tenants")) {
+                string name = tenantData.at("name").get<string>();
+                json tenantTelegram = tenantData.contains("telegram")
+                    ? tenantData.at("telegram") : json::object();
+                addTenant(name, tenantTelegram, tenantData.at("queries"),
+                          getOptionalValue<string>(tenantData, "cache")
+                              .value_or(tenantCachePath(
+                                  programConfiguration.files.cache.path, name)),
+                          programConfiguration);
             }
-
-            kufarConfiguration.language =
-                getOptionalValue<string>(
-                    query, "language");
-            kufarConfiguration.limit = getOptionalValue<int>(query, "limit");
-            kufarConfiguration.currency =
-                getOptionalValue<string>(
-                    query, "currency");
-            kufarConfiguration.condition =
-                getOptionalValue<ItemCondition>(
-                    query, "condition");
-            kufarConfiguration.sellerType =
-                getOptionalValue<SellerType>(
-                    query, "seller-type");
-            kufarConfiguration.kufarDeliveryRequired =
-                getOptionalValue<bool>(
-                    query, "kufar-delivery-required");
-            kufarConfiguration.kufarPaymentRequired =
-                getOptionalValue<bool>(
-                    query, "kufar-payment-required");
-            kufarConfiguration.kufarHalvaRequired =
-                getOptionalValue<bool>(
-                    query, "kufar-halva-required");
-            kufarConfiguration.onlyWithPhotos =
-                getOptionalValue<bool>(
-                    query, "only-with-photos");
-            kufarConfiguration.onlyWithVideos =
-                getOptionalValue<bool>(
-                    query, "only-with-videos");
-            kufarConfiguration.onlyWithExchangeAvailable =
-                getOptionalValue<bool>(
-                    query, "only-with-exchange-available");
-            kufarConfiguration.sortType =
-                getOptionalValue<SortType>(
-                    query, "sort-type");
-            kufarConfiguration.category =
-                getOptionalValue<Category>(
-                    query, "category");
-            kufarConfiguration.subCategory =
-                getOptionalValue<int>(
-                    query, "sub-category");
-            kufarConfiguration.region =
-                getOptionalValue<Region>(
-                    query, "region");
-            kufarConfiguration.areas =
-                getOptionalValue<vector<int>>(query, "areas");
-            programConfiguration.kufarConfiguration
-                .push_back(kufarConfiguration);
-
-            index += 1;
         }
     }
     {
         if (data.contains("delays")) {
             json delaysData = data.at("delays");
-            programConfiguration.queryDelaySeconds = delaysData.at("query");
             programConfiguration.loopDelaySeconds = delaysData.at("loop");
         }
     }
+    {
+        if (data.contains("network")) {
+            json networkData = data.at("network");
+            programConfiguration.maxRequestsInFlight =
+                getOptionalValue<unsigned int>(networkData, "max-in-flight")
+                    .value_or(programConfiguration.maxRequestsInFlight);
+            programConfiguration.pipeline.reuseWindow = chrono::milliseconds(
+                getOptionalValue<int>(networkData, "reuse-window-ms")
+                    .value_or(programConfiguration.pipeline.reuseWindow.count()));
+        }
+    }
+    {
+        if (data.contains("pagination")) {
+            json paginationData = data.at("pagination");
+            programConfiguration.maxPages =
+                getOptionalValue<int>(paginationData, "max-pages")
+                    .value_or(programConfiguration.maxPages);
+            programConfiguration.pipeline.backfillMaxPages =
+                getOptionalValue<int>(paginationData, "backfill-max-pages")
+                    .value_or(programConfiguration.pipeline.backfillMaxPages);
+        }
+    }
+    {
+        if (data.contains("planner")) {
+            json plannerData = data.at("planner");
+            programConfiguration.coalesceQueries =
+                getOptionalValue<bool>(plannerData, "coalesce")
+                    .value_or(programConfiguration.coalesceQueries);
+            programConfiguration.coalescedMaxPages =
+                getOptionalValue<int>(plannerData, "coalesced-max-pages")
+                    .value_or(programConfiguration.coalescedMaxPages);
+        }
+    }
+    {
+        if (data.contains("watermarks")) {
+            json watermarkData = data.at("watermarks");
+            programConfiguration.useWatermarks =
+                getOptionalValue<bool>(watermarkData, "enabled")
+                    .value_or(programConfiguration.useWatermarks);
+            programConfiguration.pipeline.watermarkSafetySeconds =
+                getOptionalValue<int>(watermarkData, "safety-window")
+                    .value_or(programConfiguration.pipeline.watermarkSafetySeconds);
+        }
+    }
+    {
+        if (data.contains("pipeline")) {
+            json pipelineData = data.at("pipeline");
+            PipelineOptions &pipeline = programConfiguration.pipeline;
+            pipeline.parseThreads =
+                getOptionalValue<unsigned int>(pipelineData, "parse-threads")
+                    .value_or(pipeline.parseThreads);
+            pipeline.queueDepth =
+                getOptionalValue<size_t>(pipelineData, "queue-depth")
+                    .value_or(pipeline.queueDepth);
+        }
+    }
+    {
+        if (data.contains("scheduler")) {
+            json schedulerData = data.at("scheduler");
+            AdaptiveSchedule &adaptive = programConfiguration.adaptiveSchedule;
+            string mode =
+                getOptionalValue<string>(schedulerData, "mode").value_or("fixed");
+            if (mode == "adaptive") {
+                adaptive.enabled = true;
+            } else if (mode != "fixed") {
+                Log::error("Unknown scheduler mode: " + mode);
+                exit(1);
+            }
+            adaptive.requestsPerMinute =
+                getOptionalValue<double>(schedulerData, "requests-per-minute")
+                    .value_or(adaptive.requestsPerMinute);
+            adaptive.minIntervalSeconds =
+                getOptionalValue<int>(schedulerData, "min-interval")
+                    .value_or(adaptive.minIntervalSeconds);
+            adaptive.maxIntervalSeconds =
+                getOptionalValue<int>(schedulerData, "max-interval")
+                    .value_or(adaptive.maxIntervalSeconds);
+        }
+    }
+    {
+        if (data.contains("metrics")) {
+            json metricsData = data.at("metrics");
+            Metrics::ExporterOptions &metrics = programConfiguration.metrics;
+            metrics.address =
+                getOptionalValue<string>(metricsData, "address")
+                    .value_or(metrics.address);
+            metrics.port =
+                getOptionalValue<int>(metricsData, "port").value_or(metrics.port);
+            metrics.filePath =
+                getOptionalValue<string>(metricsData, "file")
+                    .value_or(metrics.filePath);
+            metrics.interval = chrono::seconds(
+                getOptionalValue<int>(metricsData, "interval")
+                    .value_or(metrics.interval.count()));
+        }
+    }
+    {
+        if (data.contains("logging")) {
+            json loggingData = data.at("logging");
+            string level =
+                getOptionalValue<string>(loggingData, "level").value_or("info");
+            if (level == "debug") {
+                Log::setLevel(Log::Level::debug);
+            } else if (level == "info") {
+                Log::setLevel(Log::Level::info);
+            } else if (level == "warn") {
+                Log::setLevel(Log::Level::warn);
+            } else if (level == "error") {
+                Log::setLevel(Log::Level::error);
+            } else {
+                Log::error("Unknown logging level: " + level);
+                exit(1);
+            }
+        }
+    }
 }
 
-json getJSONDataFromPath(const string &JSONFilePath,
-                          bool isCache = false) {
+json getJSONDataFromPath(const string &JSONFilePath) {
     Log::info("Loading file: \"" + JSONFilePath + "\"");
 
     if (!fileExists(JSONFilePath)) {
-        if (isCache) {
-            Log::info("Cache file not found, creating empty cache");
-            saveFile(JSONFilePath, json::array().dump());
-            return json::array();
-        } else {
-            Log::error("File does not exist: " + JSONFilePath);
-            exit(1);
-        }
+        Log::error("File does not exist: " + JSONFilePath);
+        exit(1);
     }
     if (getFileSize(JSONFilePath) > 4000000) {
         Log::error("File over 4MB: " + JSONFilePath);
@@ -170,6 +444,9 @@ json getJSONDataFromPath(const string &JSONFilePath,
 const string prefixConfigurationFile = "--config=";
 const string prefixCacheFile = "--cache=";
 const string prefixLogFile = "--log=";
+const string flagConvertCache = "--convert-cache";
+const string flagBackfill = "--backfill";
+const string prefixTraceFile = "--trace=";
 
 Files getFiles(const int &argsCount, char **args) {
     Files files;
@@ -186,6 +463,13 @@ Files getFiles(const int &argsCount, char **args) {
         } else if (stringHasPrefix(currentArgument, prefixLogFile)) {
             currentArgument.erase(0, prefixLogFile.length());
             files.logPath = currentArgument;
+        } else if (currentArgument == flagConvertCache) {
+            files.convertCache = true;
+        } else if (currentArgument == flagBackfill) {
+            files.backfill = true;
+        } else if (stringHasPrefix(currentArgument, prefixTraceFile)) {
+            currentArgument.erase(0, prefixTraceFile.length());
+            files.tracePath = currentArgument;
         }
     }
 
@@ -215,11 +499,118 @@ Files getFiles(const int &argsCount, char **args) {
     }
     files.configuration.contents =
         getJSONDataFromPath(files.configuration.path);
-    files.cache.contents = getJSONDataFromPath(files.cache.path, true);
 
     return files;
 }
 
+void logQueryPlans(const vector<QueryPlan> &queryPlans, size_t queryCount) {
+    size_t filtered = 0;
+    for (const QueryPlan &plan : queryPlans) {
+        if (plan.filtersLocally()) {
+            filtered++;
+        }
+    }
+    char fanIn[16];
+    snprintf(fanIn, sizeof(fanIn), "%.2f",
+             queryPlans.empty() ? 0.0 : double(queryCount) / queryPlans.size());
+    Log::info("Compiled " + to_string(queryPlans.size()) + " query plans from " +
+              to_string(queryCount) + " queries: fanIn=" + fanIn +
+              " locallyFiltered=" + to_string(filtered));
+}
+
+void logConnectionPoolStats() {
+    for (const auto &entry : Networking::getPoolStats()) {
+        const Networking::PoolStats &stats = entry.second;
+        Log::info("Connection pool host=" + entry.first +
+                  " requests=" + to_string(stats.requests) +
+                  " reused=" + to_string(stats.handleReuses) +
+                  " newHandles=" + to_string(stats.newHandles) +
+                  " newConnections=" + to_string(stats.newConnections) +
+                  " handshakeMs=" +
+                      to_string((long long)(stats.handshakeSeconds * 1000)) +
+                  " wireBytes=" + to_string(stats.wireBytes) +
+                  " decodedBytes=" + to_string(stats.decodedBytes) +
+                  " notModified=" + to_string(stats.notModified));
+    }
+    Networking::SingleFlightStats singleFlight = Networking::getSingleFlightStats();
+    Log::info("Single-flight: transfers=" + to_string(singleFlight.transfers) +
+              " joined=" + to_string(singleFlight.joined) +
+              " reused=" + to_string(singleFlight.reused));
+}
+
+void logLoggerStats() {
+    Log::Stats stats = Log::stats();
+    Log::info("Logger: written=" + to_string(stats.written) +
+              " dropped=" + to_string(stats.dropped));
+}
+
+void logDeliveryStats(const DeliveryStats &stats) {
+    double averageLatency = stats.delivered > 0
+        ? stats.totalLatencySeconds / stats.delivered : 0;
+    Log::info("Telegram delivery: delivered=" + to_string(stats.delivered) +
+              " failed=" + to_string(stats.failed) +
+              " throttled=" + to_string(stats.throttled) +
+              " retried=" + to_string(stats.retried) +
+              " avgLatencyMs=" + to_string((long long)(averageLatency * 1000)) +
+              " maxLatencyMs=" +
+                  to_string((long long)(stats.maxLatencySeconds * 1000)));
+}
+
+void logPipelineStats(const vector<StageStats> &current,
+                      vector<StageStats> &previous,
+                      chrono::duration<double> elapsed) {
+    for (size_t i = 0; i < current.size(); i++) {
+        const StageStats &stage = current[i];
+        uint64_t processedBefore = i < previous.size() ? previous[i].processed : 0;
+        double busyBefore = i < previous.size() ? previous[i].busySeconds : 0;
+        double seconds = max(elapsed.count(), 1e-3);
+        Log::info("Pipeline stage=" + stage.name +
+                  " threads=" + to_string(stage.threads) +
+                  " processed=" + to_string(stage.processed) +
+                  " perMin=" + to_string((long long)(
+                      (stage.processed - processedBefore) * 60 / seconds)) +
+                  " failed=" + to_string(stage.failed) +
+                  (stage.skipped > 0
+                      ? " skipped=" + to_string(stage.skipped) + " skipPct=" +
+                            to_string(stage.skipped * 100 / stage.processed)
+                      : string()) +
+                  (stage.shared > 0 ? " shared=" + to_string(stage.shared)
+                                    : string()) +
+                  " depth=" + to_string(stage.queueDepth) + "/" +
+                      to_string(stage.queueCapacity) +
+                  " peakDepth=" + to_string(stage.peakQueueDepth) +
+                  " busyPct=" + to_string((long long)(
+                      (stage.busySeconds - busyBefore) * 100 /
+                      (seconds * max(stage.threads, 1u)))));
+    }
+    previous = current;
+}
+
+void logScheduleStats(const vector<QueryPlan> &queryPlans,
+                      const QueryScheduler &scheduler) {
+    for (const auto &stats : scheduler.stats()) {
+        Log::info("Schedule tag=" + queryPlans[stats.query].label +
+                  " intervalS=" + to_string(stats.interval.count() / 1000) +
+                  " runs=" + to_string(stats.runs) +
+                  " missed=" + to_string(stats.missedSlots) +
+                  " lastLagMs=" + to_string((long long)(stats.lastLagSeconds * 1000)) +
+                  " maxLagMs=" + to_string((long long)(stats.maxLagSeconds * 1000)));
+    }
+}
+
+void rebalanceSchedule(const vector<QueryPlan> &queryPlans,
+                       const AdaptivePolicy &policy,
+                       QueryScheduler &scheduler) {
+    for (const auto &estimate : policy.allocate()) {
+        scheduler.setInterval(estimate.query, estimate.interval);
+        Log::info("Adaptive schedule tag=" + queryPlans[estimate.query].label +
+                  " arrivalsPerHour=" + to_string(estimate.arrivalsPerHour) +
+                  " intervalS=" + to_string(estimate.interval.count() / 1000) +
+                  " expectedDelayS=" +
+                      to_string((long long)estimate.expectedDelaySeconds));
+    }
+}
+
 static volatile sig_atomic_t g_shutdown_requested = 0;
 
 static void shutdown_handler(int sig) {
@@ -227,11 +618,34 @@ static void shutdown_handler(int sig) {
     g_shutdown_requested = 1;
 }
 
+static void trace_handler(int sig) {
+    (void)sig;
+    Tracing::requestDump();
+}
+
+void dumpTrace(const string &path) {
+    if (path.empty()) {
+        Log::warn("Trace dump requested, but tracing is off; start with " +
+                  prefixTraceFile + "<path>");
+        return;
+    }
+    try {
+        size_t events = Tracing::dump(path);
+        Log::info("Trace written: " + to_string(events) + " events to " + path);
+    } catch (const exception &exc) {
+        Log::error("Cannot write trace: " + string(exc.what()));
+    }
+}
+
 int main(int argc, char **argv) {
     ProgramConfiguration programConfiguration;
-    vector<AdPrice> cachedAds;
 
     programConfiguration.files = getFiles(argc, argv);
+    const string &tracePath = programConfiguration.files.tracePath;
+    if (!tracePath.empty()) {
+        Tracing::enable();
+        Tracing::setThreadName("main");
+    }
 
     Log::info("Starting ads-scanner pid=" + to_string(getpid()) +
               " config=" + programConfiguration.files.configuration.path +
@@ -242,109 +656,238 @@ int main(int argc, char **argv) {
         programConfiguration.files.configuration
             .contents,
         programConfiguration);
-    cachedAds = programConfiguration.files.cache.contents
-        .get<vector<AdPrice>>();
+
+    // Built in place: a tenant is not copyable and the pipeline keeps a
+    // reference to the vector.
+    vector<Tenant> tenants(programConfiguration.tenants.size());
+    for (size_t i = 0; i < tenants.size(); i++) {
+        const TenantConfiguration &configuration = programConfiguration.tenants[i];
+        Tenant &tenant = tenants[i];
+        tenant.name = configuration.name;
+        tenant.chats = configuration.chats;
+        tenant.cacheJournal = make_unique<CacheJournal>(configuration.cachePath);
+        try {
+            size_t replayed = tenant.cacheJournal->load(tenant.seenAds);
+            Log::info("Cache loaded for tenant=" + tenant.name + ": " +
+                      to_string(tenant.seenAds.size()) + " ads, " +
+                      to_string(replayed) + " journal records replayed" +
+                      (tenant.cacheJournal->format() == CacheJournal::Format::binary
+                          ? " (binary)" : " (json)"));
+        } catch (const exception &exc) {
+            Log::error("Cannot load cache of tenant=" + tenant.name + ": " +
+                       exc.what());
+            exit(1);
+        }
+    }
+    auto countSeenAds = [&tenants] {
+        size_t count = 0;
+        for (const Tenant &tenant : tenants) {
+            count += tenant.seenAds.size();
+        }
+        return count;
+    };
+
+    if (programConfiguration.files.convertCache) {
+        for (Tenant &tenant : tenants) {
+            try {
+                tenant.cacheJournal->convertToBinary(tenant.seenAds);
+                Log::info("Cache of tenant=" + tenant.name +
+                          " converted to binary format: " +
+                          to_string(tenant.seenAds.size()) + " ads");
+            } catch (const exception &exc) {
+                Log::error("Cache conversion failed for tenant=" +
+                           tenant.name + ": " + exc.what());
+                return 1;
+            }
+        }
+        return 0;
+    }
 
     if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
         Log::error("curl_global_init failed");
         return 1;
     }
+    Networking::setReuseWindow(programConfiguration.pipeline.reuseWindow);
 
 #ifdef SIGPIPE
     signal(SIGPIPE, SIG_IGN);
 #endif
     signal(SIGTERM, shutdown_handler);
     signal(SIGINT, shutdown_handler);
+#ifdef SIGUSR1
+    signal(SIGUSR1, trace_handler);
+#endif
+
+    Sender sender(programConfiguration.telegramConfiguration,
+                  programConfiguration.notificationQueueCapacity);
+    const bool backfill = programConfiguration.files.backfill;
+    if (!backfill) {
+        sender.start();
+    }
+
+    const vector<QueryPlan> queryPlans = compileQueryPlans(
+        programConfiguration.kufarConfiguration,
+        programConfiguration.loopDelaySeconds,
+        programConfiguration.maxPages,
+        programConfiguration.coalesceQueries,
+        programConfiguration.coalescedMaxPages);
+    logQueryPlans(queryPlans, programConfiguration.kufarConfiguration.size());
+    Log::info("Serving " + to_string(tenants.size()) + " tenants");
+
+    QueryScheduler scheduler;
+    for (const QueryPlan &plan : queryPlans) {
+        scheduler.add(chrono::seconds(plan.intervalSeconds),
+                      chrono::seconds(plan.jitterSeconds));
+    }
+
+    const AdaptiveSchedule &adaptive = programConfiguration.adaptiveSchedule;
+    AdaptivePolicy adaptivePolicy(adaptive.requestsPerMinute,
+                                  chrono::seconds(adaptive.minIntervalSeconds),
+                                  chrono::seconds(adaptive.maxIntervalSeconds));
+    adaptivePolicy.resize(scheduler.size());
+    if (adaptive.enabled) {
+        Log::info("Adaptive scheduling: budget=" +
+                  to_string(adaptive.requestsPerMinute) + " requests/min");
+        rebalanceSchedule(queryPlans, adaptivePolicy, scheduler);
+    }
+
+    WatermarkStore watermarks(programConfiguration.files.cache.path +
+                              ".watermarks.json");
+    if (programConfiguration.useWatermarks) {
+        try {
+            watermarks.load();
+            Log::info("Watermarks loaded: " + to_string(watermarks.size()) +
+                      " queries, safety window " +
+                      to_string(programConfiguration.pipeline.watermarkSafetySeconds) +
+                      " s");
+        } catch (const exception &exc) {
+            // Only costs full parses until the next save.
+            Log::error("Cannot load watermarks: " + string(exc.what()));
+        }
+    }
+
+    Metrics::Exporter metricsExporter(programConfiguration.metrics);
+    try {
+        metricsExporter.start();
+    } catch (const exception &exc) {
+        Log::error("Cannot start metrics exporter: " + string(exc.what()));
+        return 1;
+    }
+    if (programConfiguration.metrics.port > 0) {
+        Log::info("Serving metrics on http://" + programConfiguration.metrics.address +
+                  ":" + to_string(programConfiguration.metrics.port) + "/metrics");
+    }
+
+    programConfiguration.pipeline.backfill = backfill;
+    ScanPipeline pipeline(programConfiguration.kufarConfiguration,
+                          programConfiguration.tenantOfQuery, queryPlans,
+                          tenants, sender,
+                          adaptive.enabled && !backfill ? &adaptivePolicy : nullptr,
+                          programConfiguration.useWatermarks ? &watermarks : nullptr,
+                          programConfiguration.pipeline);
+    pipeline.start();
+    vector<StageStats> pipelineStats;
+
+    if (backfill) {
+        Log::info("Backfill: crawling up to " +
+                  to_string(programConfiguration.pipeline.backfillMaxPages) +
+                  " pages of " + to_string(queryPlans.size()) + " queries");
+        auto backfillStart = QueryScheduler::Clock::now();
+        size_t adsBefore = countSeenAds();
+        vector<size_t> allPlans(queryPlans.size());
+        iota(allPlans.begin(), allPlans.end(), 0);
+        pipeline.fetch(allPlans, programConfiguration.maxRequestsInFlight);
+        while (!g_shutdown_requested && !pipeline.idle()) {
+            if (Tracing::dumpRequested()) {
+                dumpTrace(tracePath);
+            }
+            if (pipeline.hasFollowUps()) {
+                pipeline.fetch({}, programConfiguration.maxRequestsInFlight);
+            } else {
+                this_thread::sleep_for(chrono::milliseconds(50));
+            }
+        }
+        pipeline.shutdown();
+        logPipelineStats(pipeline.stats(), pipelineStats,
+                         QueryScheduler::Clock::now() - backfillStart);
+        Log::info("Backfill finished: " +
+                  to_string(countSeenAds() - adsBefore) + " ads added, " +
+                  to_string(countSeenAds()) + " in cache");
+        sender.shutdown();
+        Networking::cleanupConnectionPool();
+        curl_global_cleanup();
+        if (!tracePath.empty()) {
+            dumpTrace(tracePath);
+        }
+        return g_shutdown_requested ? 1 : 0;
+    }
+
+    Metrics::Histogram &batchDuration = Metrics::histogram(
+        "ads_scan_batch_duration_seconds",
+        "Time to fetch one batch of due queries", 1e-6);
+    Metrics::Gauge &lastBatch = Metrics::gauge(
+        "ads_scan_last_batch_timestamp_seconds",
+        "Unix time the last batch of due queries was fetched");
 
     unsigned long long loopNum = 0;
+    auto lastReport = QueryScheduler::Clock::now();
+    auto nextReport = lastReport + STATS_REPORT_INTERVAL;
     while (true) {
         if (g_shutdown_requested) {
             Log::info("Shutdown requested by signal, exiting.");
             break;
         }
+        if (Tracing::dumpRequested()) {
+            dumpTrace(tracePath);
+        }
 
-        Log::info("Loop " + to_string(loopNum) + " started");
-        if (loopNum > 0 && loopNum % 20 == 0)
-            Log::info("Heartbeat: " + to_string(loopNum) + " loops completed");
-
-        for (auto requestConfiguration :
-            programConfiguration.kufarConfiguration) {
-            unsigned int sentCount = 0;
-            string tagStr = requestConfiguration.tag.value_or("(no tag)");
-            Log::info("Processing query tag=" + tagStr);
-
-            try {
-                vector<Ad> currentAds = getAds(requestConfiguration);
-                Log::info("getAds returned " + to_string(currentAds.size()) + " ads for tag=" + tagStr);
-
-                // Process each ad
-                for (const auto &advert : currentAds) {
-                    auto cachedPrice =
-                        getPriceFromCache(cachedAds, advert.id);
-
-                    if (!cachedPrice.has_value()) {
-                        Log::info("New ad: Title=" + advert.title + " ID=" + to_string(advert.id) +
-                                  " Tag=" + (advert.tag.value_or("")) + " Link=" + advert.link);
-                        cachedAds.push_back({advert.id, advert.price});
-                        sentCount += 1;
-
-                        try {
-                            sendAdvert(
-                                programConfiguration
-                                    .telegramConfiguration,
-                                advert);
-                        } catch (const exception &exc) {
-                            Log::error("sendAdvert failed: " + string(exc.what()));
-                        }
-                    } else if (advert.price <
-                               cachedPrice.value()) {
-                        Log::info("Price drop: Title=" + advert.title + " ID=" + to_string(advert.id) +
-                                  " Old=" + to_string(cachedPrice.value()) + " New=" + to_string(advert.price));
-
-                        // Update cached price
-                        for (auto &item : cachedAds) {
-                            if (item.id == advert.id) {
-                                item.price = advert.price;
-                                break;
-                            }
-                        }
-                        sentCount += 1;
-
-                        try {
-                            sendAdvert(
-                                programConfiguration
-                                    .telegramConfiguration,
-                                advert);
-                        } catch (const exception &exc) {
-                            Log::error("sendAdvert failed: " + string(exc.what()));
-                        }
-                    }
-                    usleep(300000); // 0.3s
-                }
-            } catch (const exception &exc) {
-                Log::error("getAds failed for tag=" + tagStr + ": " + exc.what());
+        auto now = QueryScheduler::Clock::now();
+        if (now >= nextReport) {
+            Log::info("Heartbeat: " + to_string(loopNum) + " batches dispatched");
+            logScheduleStats(queryPlans, scheduler);
+            logConnectionPoolStats();
+            logDeliveryStats(sender.stats());
+            logPipelineStats(pipeline.stats(), pipelineStats, now - lastReport);
+            logLoggerStats();
+            lastReport = now;
+            if (adaptive.enabled) {
+                rebalanceSchedule(queryPlans, adaptivePolicy, scheduler);
             }
+            nextReport = now + STATS_REPORT_INTERVAL;
+        }
 
-            sleep(programConfiguration.queryDelaySeconds);
-            if (sentCount > 0) {
-                try {
-                    saveFile(
-                            programConfiguration.files.cache.path,
-                            ((json)cachedAds).dump());
-                    Log::info("Cache saved to " + programConfiguration.files.cache.path);
-                } catch (const exception &exc) {
-                    Log::error("saveFile failed: " + string(exc.what()));
-                }
-            }
+        vector<size_t> dueQueries = scheduler.takeDue(now);
+        if (dueQueries.empty() && !pipeline.hasFollowUps()) {
+            // Sleep in short steps so a shutdown signal is noticed quickly.
+            auto wakeUp = min(scheduler.nextDue(), nextReport);
+            this_thread::sleep_for(min<QueryScheduler::Clock::duration>(
+                wakeUp - now, chrono::seconds(1)));
+            continue;
         }
 
-        Log::info("Loop " + to_string(loopNum) + " finished, sleeping " +
-                  to_string(programConfiguration.loopDelaySeconds) + "s");
-        sleep(programConfiguration.loopDelaySeconds);
+        Log::info("Batch " + to_string(loopNum) + " started: " +
+                  to_string(dueQueries.size()) + " due queries");
+        Tracing::Span span("batch", "loop");
+        span.arg("batch", static_cast<int64_t>(loopNum));
+        span.arg("due", static_cast<int64_t>(dueQueries.size()));
+        pipeline.fetch(dueQueries, programConfiguration.maxRequestsInFlight);
+        batchDuration.record(QueryScheduler::Clock::now() - now);
+        lastBatch.set(time(nullptr));
+        Log::info("Batch " + to_string(loopNum) + " fetched");
         loopNum++;
     }
 
+    logScheduleStats(queryPlans, scheduler);
+    pipeline.shutdown();
+    sender.shutdown();
+    logPipelineStats(pipeline.stats(), pipelineStats,
+                     QueryScheduler::Clock::now() - lastReport);
+    Networking::cleanupConnectionPool();
     curl_global_cleanup();
+    if (!tracePath.empty()) {
+        dumpTrace(tracePath);
+    }
     Log::info("Exiting.");
+    Log::shutdown();
     return 0;
 }
@@ -0,0 +1,154 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include "mappedcache.hpp"
+
+using namespace std;
+
+namespace {
+    const char CACHE_MAGIC[8] = {'A', 'D', 'S', 'C', 'A', 'C', 'H', 'E'};
+
+    struct CacheFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t entrySize;
+        uint64_t count;
+        uint32_t flags;
+        uint32_t checksum;
+    };
+    static_assert(sizeof(CacheFileHeader) == 32, "header must be 32 bytes");
+    static_assert(sizeof(AdPrice) == 8, "AdPrice is stored as two int32");
+
+    uint32_t headerChecksum(const CacheFileHeader &header) {
+        uint32_t hash = 2166136261u;
+        const unsigned char *bytes =
+            reinterpret_cast<const unsigned char *>(&header);
+        for (size_t i = 0; i < offsetof(CacheFileHeader, checksum); i++) {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+        return hash;
+    }
+}
+
+MappedCache::~MappedCache() {
+    unmap();
+}
+
+void MappedCache::unmap() {
+    if (mapping) {
+        munmap(mapping, mappingLength);
+    }
+    mapping = nullptr;
+    mappingLength = 0;
+    items = nullptr;
+    count = 0;
+}
+
+bool MappedCache::isBinaryCache(const string &path) {
+    ifstream ifs(path, ios::binary);
+    char magic[sizeof(CACHE_MAGIC)];
+    if (!ifs.read(magic, sizeof(magic))) {
+        return false;
+    }
+    return memcmp(magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0;
+}
+
+void MappedCache::open(const string &path) {
+    unmap();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("cannot open \"" + path + "\": " + strerror(errno));
+    }
+
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0) {
+        string reason = strerror(errno);
+        close(fd);
+        throw runtime_error("cannot stat \"" + path + "\": " + reason);
+    }
+    size_t length = static_cast<size_t>(fileInfo.st_size);
+    if (length < sizeof(CacheFileHeader)) {
+        close(fd);
+        throw runtime_error("binary cache \"" + path + "\" is truncated");
+    }
+
+    void *address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        throw runtime_error("cannot mmap \"" + path + "\": " + strerror(errno));
+    }
+
+    const CacheFileHeader *header =
+        static_cast<const CacheFileHeader *>(address);
+    string problem;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0) {
+        problem = "bad magic";
+    } else if (header->checksum != headerChecksum(*header)) {
+        problem = "header checksum mismatch";
+    } else if (header->version != VERSION) {
+        problem = "unsupported version " + to_string(header->version);
+    } else if (header->entrySize != sizeof(AdPrice)) {
+        problem = "unexpected entry size";
+    } else if (length != sizeof(CacheFileHeader) +
+                         header->count * sizeof(AdPrice)) {
+        problem = "length does not match entry count";
+    }
+    if (!problem.empty()) {
+        munmap(address, length);
+        throw runtime_error("binary cache \"" + path + "\": " + problem);
+    }
+
+    mapping = address;
+    mappingLength = length;
+    count = static_cast<size_t>(header->count);
+    items = reinterpret_cast<const AdPrice *>(
+        static_cast<const char *>(address) + sizeof(CacheFileHeader));
+    // Lookups are binary searches scattered over the file.
+    madvise(mapping, mappingLength, MADV_RANDOM);
+}
+
+void MappedCache::write(const string &path, vector<AdPrice> entries) {
+    // Stable sort keeps later duplicates after earlier ones, so keeping the
+    // last of each run makes the newest price win.
+    stable_sort(entries.begin(), entries.end(),
+                [](const AdPrice &a, const AdPrice &b) { return a.id < b.id; });
+    vector<AdPrice> unique;
+    unique.reserve(entries.size());
+    for (const auto &entry : entries) {
+        if (!unique.empty() && unique.back().id == entry.id) {
+            unique.back().price = entry.price;
+        } else {
+            unique.push_back(entry);
+        }
+    }
+
+    CacheFileHeader header{};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = VERSION;
+    header.entrySize = sizeof(AdPrice);
+    header.count = unique.size();
+    header.checksum = headerChecksum(header);
+
+    string contents(reinterpret_cast<const char *>(&header), sizeof(header));
+    contents.append(reinterpret_cast<const char *>(unique.data()),
+                    unique.size() * sizeof(AdPrice));
+    saveFileAtomically(path, contents);
+}
+
+optional<int> MappedCache::find(int id) const {
+    const AdPrice *it = lower_bound(
+        begin(), end(), id,
+        [](const AdPrice &entry, int value) { return entry.id < value; });
+    if (it != end() && it->id == id) {
+        return it->price;
+    }
+    return nullopt;
+}
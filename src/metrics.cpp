@@ -0,0 +1,382 @@
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <cmath>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "metrics.hpp"
+#include "logging.hpp"
+#include "helperfunctions.hpp"
+
+using namespace std;
+
+namespace Metrics {
+    namespace {
+        enum class Kind { counter, gauge, histogram };
+
+        struct Series {
+            string labels;  // Label pairs as rendered inside {}, may be ""
+            unique_ptr<Counter> counter;
+            unique_ptr<Gauge> gauge;
+            unique_ptr<Histogram> histogram;
+        };
+
+        struct Family {
+            Kind kind;
+            string help;
+            double unit = 1;
+            vector<double> buckets;     // Histograms only
+            // A deque keeps handed-out series in place as others are added.
+            deque<Series> series;
+        };
+
+        const size_t MAX_REQUEST_SIZE = 8192;
+        const chrono::milliseconds POLL_INTERVAL(250);
+#ifdef MSG_NOSIGNAL
+        const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+        // macOS has no MSG_NOSIGNAL; main() ignores SIGPIPE there too.
+        const int SEND_FLAGS = 0;
+#endif
+
+        mutex g_registryMutex;
+        map<string, Family> g_families;
+
+        string escapeLabelValue(const string &value) {
+            string escaped;
+            escaped.reserve(value.size());
+            for (char c : value) {
+                if (c == '\\' || c == '"') {
+                    escaped += '\\';
+                    escaped += c;
+                } else if (c == '\n') {
+                    escaped += "\\n";
+                } else {
+                    escaped += c;
+                }
+            }
+            return escaped;
+        }
+
+        string renderLabels(const Labels &labels) {
+            string rendered;
+            for (const auto &label : labels) {
+                if (!rendered.empty()) {
+                    rendered += ',';
+                }
+                rendered += label.first + "=\"" + escapeLabelValue(label.second) + '"';
+            }
+            return rendered;
+        }
+
+        string withLabels(const string &labels, const string &extra = "") {
+            if (labels.empty() && extra.empty()) {
+                return "";
+            }
+            if (labels.empty() || extra.empty()) {
+                return '{' + labels + extra + '}';
+            }
+            return '{' + labels + ',' + extra + '}';
+        }
+
+        string formatNumber(double value) {
+            char text[32];
+            // Whole numbers such as timestamps keep every digit.
+            if (value == floor(value) && fabs(value) < 1e15) {
+                snprintf(text, sizeof(text), "%.0f", value);
+            } else {
+                snprintf(text, sizeof(text), "%.9g", value);
+            }
+            return text;
+        }
+
+        Series &findOrAdd(const string &name, Kind kind, const string &help,
+                          double unit, const Labels &labels,
+                          const vector<double> &buckets = {}) {
+            lock_guard<mutex> lock(g_registryMutex);
+            auto inserted = g_families.emplace(
+                name, Family{kind, help, unit, buckets, {}});
+            Family &family = inserted.first->second;
+            if (family.kind != kind) {
+                throw logic_error("metric " + name + " registered with two types");
+            }
+            string rendered = renderLabels(labels);
+            for (Series &series : family.series) {
+                if (series.labels == rendered) {
+                    return series;
+                }
+            }
+            family.series.emplace_back();
+            Series &series = family.series.back();
+            series.labels = rendered;
+            switch (kind) {
+                case Kind::counter: series.counter = make_unique<Counter>(); break;
+                case Kind::gauge: series.gauge = make_unique<Gauge>(); break;
+                case Kind::histogram: series.histogram = make_unique<Histogram>(); break;
+            }
+            return series;
+        }
+
+        void sendAll(int socket, const string &data) {
+            size_t sent = 0;
+            while (sent < data.size()) {
+                ssize_t written = send(socket, data.data() + sent,
+                                       data.size() - sent, SEND_FLAGS);
+                if (written <= 0) {
+                    if (written < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    return;
+                }
+                sent += written;
+            }
+        }
+    }
+
+    size_t Histogram::bucketOf(uint64_t value) {
+        if (value < 2 * SUB_BUCKETS) {
+            return value;
+        }
+        int highestBit = 63 - __builtin_clzll(value);
+        int shift = highestBit - SUB_BUCKET_BITS;
+        uint64_t mantissa = value >> shift;    // In [SUB_BUCKETS, 2 * SUB_BUCKETS)
+        return 2 * SUB_BUCKETS + (shift - 1) * SUB_BUCKETS + (mantissa - SUB_BUCKETS);
+    }
+
+    uint64_t Histogram::highestValueIn(size_t bucket) {
+        if (bucket < 2 * SUB_BUCKETS) {
+            return bucket;
+        }
+        size_t offset = bucket - 2 * SUB_BUCKETS;
+        int shift = static_cast<int>(offset / SUB_BUCKETS) + 1;
+        uint64_t mantissa = offset % SUB_BUCKETS + SUB_BUCKETS;
+        // Wraps to UINT64_MAX for the last bucket, which is what it holds.
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+    void Histogram::record(uint64_t value) {
+        counts[bucketOf(value)].fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(value, memory_order_relaxed);
+    }
+
+    Histogram::Snapshot Histogram::snapshot() const {
+        Snapshot result;
+        result.buckets.resize(BUCKETS);
+        // Count from the buckets so _count agrees with the +Inf bucket
+        // even while other threads keep recording.
+        for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+            result.buckets[bucket] = counts[bucket].load(memory_order_relaxed);
+            result.count += result.buckets[bucket];
+        }
+        result.sum = sum.load(memory_order_relaxed);
+        return result;
+    }
+
+    uint64_t Histogram::Snapshot::countAtOrBelow(uint64_t value) const {
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < buckets.size() &&
+                                highestValueIn(bucket) <= value; bucket++) {
+            seen += buckets[bucket];
+        }
+        return seen;
+    }
+
+    const vector<double> &durationBuckets() {
+        static const vector<double> buckets = {
+            0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+            1, 2.5, 5, 10, 30, 60};
+        return buckets;
+    }
+
+    Counter &counter(const string &name, const string &help, const Labels &labels) {
+        return *findOrAdd(name, Kind::counter, help, 1, labels).counter;
+    }
+
+    Gauge &gauge(const string &name, const string &help, const Labels &labels) {
+        return *findOrAdd(name, Kind::gauge, help, 1, labels).gauge;
+    }
+
+    Histogram &histogram(const string &name, const string &help, double unit,
+                         const Labels &labels, const vector<double> &buckets) {
+        return *findOrAdd(name, Kind::histogram, help, unit, labels,
+                          buckets).histogram;
+    }
+
+    string render() {
+        string text;
+        lock_guard<mutex> lock(g_registryMutex);
+        for (const auto &entry : g_families) {
+            const string &name = entry.first;
+            const Family &family = entry.second;
+            text += "# HELP " + name + ' ' + family.help + '\n';
+            switch (family.kind) {
+                case Kind::counter: text += "# TYPE " + name + " counter\n"; break;
+                case Kind::gauge: text += "# TYPE " + name + " gauge\n"; break;
+                case Kind::histogram: text += "# TYPE " + name + " histogram\n"; break;
+            }
+            for (const Series &series : family.series) {
+                if (series.counter) {
+                    text += name + withLabels(series.labels) + ' ' +
+                            to_string(series.counter->get()) + '\n';
+                } else if (series.gauge) {
+                    text += name + withLabels(series.labels) + ' ' +
+                            formatNumber(series.gauge->get()) + '\n';
+                } else {
+                    Histogram::Snapshot snapshot = series.histogram->snapshot();
+                    for (double bound : family.buckets) {
+                        // Nudged up so 0.1 / 1e-6 still reaches 100000.
+                        double recorded = floor(bound / family.unit * (1 + 1e-9));
+                        uint64_t count = recorded >= 18446744073709551615.0
+                            ? snapshot.count
+                            : snapshot.countAtOrBelow(static_cast<uint64_t>(recorded));
+                        text += name + "_bucket" +
+                                withLabels(series.labels,
+                                           "le=\"" + formatNumber(bound) + '"') +
+                                ' ' + to_string(count) + '\n';
+                    }
+                    text += name + "_bucket" +
+                            withLabels(series.labels, "le=\"+Inf\"") + ' ' +
+                            to_string(snapshot.count) + '\n';
+                    text += name + "_sum" + withLabels(series.labels) + ' ' +
+                            formatNumber(snapshot.sum * family.unit) + '\n';
+                    text += name + "_count" + withLabels(series.labels) + ' ' +
+                            to_string(snapshot.count) + '\n';
+                }
+            }
+        }
+        return text;
+    }
+
+    Exporter::Exporter(const ExporterOptions &options) : options(options) {}
+
+    Exporter::~Exporter() {
+        shutdown();
+    }
+
+    void Exporter::start() {
+        if (options.port > 0) {
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(static_cast<uint16_t>(options.port));
+            if (inet_pton(AF_INET, options.address.c_str(), &address.sin_addr) != 1) {
+                throw runtime_error("invalid metrics address: " + options.address);
+            }
+            listener = socket(AF_INET, SOCK_STREAM, 0);
+            if (listener < 0) {
+                throw runtime_error("cannot create metrics socket: " +
+                                    string(strerror(errno)));
+            }
+            fcntl(listener, F_SETFD, FD_CLOEXEC);
+            int reuse = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (bind(listener, reinterpret_cast<sockaddr *>(&address),
+                     sizeof(address)) != 0 ||
+                listen(listener, 16) != 0) {
+                string reason = strerror(errno);
+                close(listener);
+                listener = -1;
+                throw runtime_error("cannot listen on " + options.address + ":" +
+                                    to_string(options.port) + ": " + reason);
+            }
+        }
+        if (listener >= 0 || !options.filePath.empty()) {
+            worker = thread(&Exporter::run, this);
+        }
+    }
+
+    void Exporter::shutdown() {
+        if (stopping.exchange(true)) {
+            return;
+        }
+        if (worker.joinable()) {
+            worker.join();
+            writeFile();
+        }
+        if (listener >= 0) {
+            close(listener);
+            listener = -1;
+        }
+    }
+
+    void Exporter::run() {
+        auto nextWrite = chrono::steady_clock::now() + options.interval;
+        while (!stopping.load()) {
+            if (listener >= 0) {
+                pollfd ready{listener, POLLIN, 0};
+                if (poll(&ready, 1, static_cast<int>(POLL_INTERVAL.count())) > 0 &&
+                    (ready.revents & POLLIN)) {
+                    int client = accept(listener, nullptr, nullptr);
+                    if (client >= 0) {
+                        serve(client);
+                        close(client);
+                    }
+                }
+            } else {
+                this_thread::sleep_for(POLL_INTERVAL);
+            }
+
+            auto now = chrono::steady_clock::now();
+            if (now >= nextWrite) {
+                writeFile();
+                nextWrite = now + options.interval;
+            }
+        }
+    }
+
+    void Exporter::serve(int client) {
+        // One scraper at a time is plenty; a stalled client must not hold
+        // the thread for long.
+        timeval timeout{2, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == string::npos &&
+               request.size() < MAX_REQUEST_SIZE) {
+            ssize_t received = recv(client, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                break;
+            }
+            request.append(buffer, received);
+        }
+
+        string path;
+        if (request.compare(0, 4, "GET ") == 0) {
+            path = request.substr(4, request.find(' ', 4) - 4);
+            path = path.substr(0, path.find('?'));
+        }
+        if (path == "/metrics" || path == "/") {
+            string body = render();
+            sendAll(client, "HTTP/1.1 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                            "Content-Length: " + to_string(body.size()) + "\r\n"
+                            "Connection: close\r\n\r\n" + body);
+        } else {
+            sendAll(client, "HTTP/1.1 404 Not Found\r\n"
+                            "Content-Length: 0\r\n"
+                            "Connection: close\r\n\r\n");
+        }
+    }
+
+    void Exporter::writeFile() {
+        if (options.filePath.empty()) {
+            return;
+        }
+        try {
+            saveFileAtomically(options.filePath, render());
+        } catch (const exception &exc) {
+            Log::error("Metrics file write failed: " + string(exc.what()));
+        }
+    }
+};
@@ -1,67 +1,645 @@
 #include <iostream>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <cctype>
+#include <cstdlib>
+#include <unordered_map>
 #include <curl/curl.h>
 #include "networking.hpp"
+#include "xxhash64.hpp"
 #include "helperfunctions.hpp"
 #include "logging.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
 
 namespace Networking {
     using std::string;
+    using std::vector;
+    using std::map;
     using std::endl;
     using std::cout;
 
     namespace {
+        // Idle handles kept per host. Each easy handle owns its own
+        // connection cache, so a reused handle reuses its warm TCP + TLS
+        // connection instead of doing a new handshake.
+        const size_t MAX_IDLE_HANDLES_PER_HOST = 4;
+
+        std::mutex g_poolMutex;
+        map<string, vector<CURL *>> g_idleHandles;
+        map<string, PoolStats> g_poolStats;
+
+        // Transfers added to a multi handle use the multi handle's
+        // connection cache, so it is kept alive between fetchAll() calls.
+        std::mutex g_multiMutex;
+        CURLM *g_multi = nullptr;
+
+        // Recent successful results by request key, for the reuse window.
+        struct RecentResult {
+            std::chrono::steady_clock::time_point received;
+            FetchResult result;
+        };
+        std::mutex g_singleFlightMutex;
+        std::chrono::milliseconds g_reuseWindow{0};
+        std::unordered_map<string, RecentResult> g_recentResults;
+        SingleFlightStats g_singleFlightStats;
+
+        string requestKey(const FetchRequest &request) {
+            return request.url + '\n' + request.etag + '\n' + request.lastModified;
+        }
+
+        // A copy of a recent result for key, dropping expired ones first.
+        std::optional<FetchResult> takeRecentResult(const string &key) {
+            std::lock_guard<std::mutex> lock(g_singleFlightMutex);
+            auto now = std::chrono::steady_clock::now();
+            for (auto it = g_recentResults.begin(); it != g_recentResults.end();) {
+                if (now - it->second.received > g_reuseWindow) {
+                    it = g_recentResults.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            auto found = g_recentResults.find(key);
+            if (found == g_recentResults.end()) {
+                return std::nullopt;
+            }
+            g_singleFlightStats.reused++;
+            return found->second.result;
+        }
+
+        void rememberResult(const string &key, const FetchResult &result) {
+            std::lock_guard<std::mutex> lock(g_singleFlightMutex);
+            if (!result.ok || g_reuseWindow.count() <= 0) {
+                return;
+            }
+            g_recentResults[key] = {std::chrono::steady_clock::now(), result};
+        }
+
+        struct Transfer {
+            size_t index;
+            string host;
+            string body;
+            XXHash64 bodyHash;
+            ResponseHeaders headers;
+            struct curl_slist *requestHeaders = nullptr;
+            CURL *curl;
+            Tracing::Clock::time_point started;
+        };
+
         static size_t writeFunction(void *ptr, size_t size,
                                         size_t nmemb,
                                         string *data) {
             data->append((char*)ptr, size * nmemb);
             return size * nmemb;
         }
+
+        static size_t transferWriteFunction(void *ptr, size_t size,
+                                            size_t nmemb,
+                                            Transfer *transfer) {
+            transfer->body.append((char*)ptr, size * nmemb);
+            transfer->bodyHash.update(ptr, size * nmemb);
+            return size * nmemb;
+        }
+
+        // One call per header line, including the status line of every
+        // response (a redirect or 100-continue starts a new header block).
+        static size_t headerFunction(char *buffer, size_t size, size_t nitems,
+                                     ResponseHeaders *headers) {
+            size_t length = size * nitems;
+            string line(buffer, length);
+            while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) {
+                line.pop_back();
+            }
+
+            if (line.compare(0, 5, "HTTP/") == 0) {
+                headers->fields.clear();
+                size_t space = line.find(' ');
+                headers->status = space == string::npos
+                    ? 0 : std::strtol(line.c_str() + space + 1, nullptr, 10);
+                return length;
+            }
+
+            size_t colon = line.find(':');
+            if (colon == string::npos || colon == 0) {
+                return length;
+            }
+            string name = line.substr(0, colon);
+            for (char &c : name) {
+                c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            }
+            size_t valueBegin = line.find_first_not_of(" \t", colon + 1);
+            size_t valueEnd = line.find_last_not_of(" \t");
+            headers->fields[name] = valueBegin == string::npos
+                ? string() : line.substr(valueBegin, valueEnd - valueBegin + 1);
+            return length;
+        }
+
+        string hostFromURL(const string &url) {
+            size_t begin = url.find("://");
+            begin = (begin == string::npos) ? 0 : begin + 3;
+            size_t end = url.find_first_of("/?#", begin);
+            return url.substr(begin,
+                end == string::npos ? string::npos : end - begin);
+        }
+
+        CURL *acquireHandle(const string &host) {
+            CURL *curl = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(g_poolMutex);
+                auto &idle = g_idleHandles[host];
+                PoolStats &stats = g_poolStats[host];
+                stats.requests++;
+                if (!idle.empty()) {
+                    curl = idle.back();
+                    idle.pop_back();
+                    stats.handleReuses++;
+                } else {
+                    stats.newHandles++;
+                }
+            }
+
+            if (curl) {
+                // Resets options only; live connections, the DNS cache
+                // and TLS session IDs are kept by the handle.
+                curl_easy_reset(curl);
+                return curl;
+            }
+            return curl_easy_init();
+        }
+
+        // Headers + body bytes received, before content decoding.
+        uint64_t wireBytesOf(CURL *curl) {
+            curl_off_t body = 0;
+            long headers = 0;
+            curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &body);
+            curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &headers);
+            return static_cast<uint64_t>(body) + static_cast<uint64_t>(headers);
+        }
+
+        struct HostMetrics {
+            Metrics::Counter *requests;
+            Metrics::Counter *failures;
+            Metrics::Histogram *latency;
+            Metrics::Histogram *responseBytes;
+        };
+        // Series of each host, looked up once; guarded by g_poolMutex.
+        map<string, HostMetrics> g_hostMetrics;
+
+        void recordTransfer(const string &host, CURL *curl, bool ok,
+                            size_t decodedBytes) {
+            HostMetrics metrics;
+            {
+                std::lock_guard<std::mutex> lock(g_poolMutex);
+                auto found = g_hostMetrics.find(host);
+                if (found == g_hostMetrics.end()) {
+                    Metrics::Labels labels = {{"host", host}};
+                    HostMetrics added;
+                    added.requests = &Metrics::counter("ads_http_requests_total",
+                        "HTTP transfers performed", labels);
+                    added.failures = &Metrics::counter("ads_http_failures_total",
+                        "HTTP transfers that failed or got a non-2xx/304 status", labels);
+                    added.latency = &Metrics::histogram("ads_http_request_duration_seconds",
+                        "Time from starting a transfer to its last byte", 1e-6, labels);
+                    added.responseBytes = &Metrics::histogram("ads_http_response_bytes",
+                        "Decoded size of successful response bodies", 1, labels,
+                        {1024, 4096, 16384, 65536, 262144, 1048576, 4194304});
+                    found = g_hostMetrics.emplace(host, added).first;
+                }
+                metrics = found->second;
+            }
+            curl_off_t totalTime = 0;
+            curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &totalTime);
+            metrics.requests->add();
+            metrics.latency->record(static_cast<uint64_t>(totalTime));
+            if (ok) {
+                metrics.responseBytes->record(decodedBytes);
+            } else {
+                metrics.failures->add();
+            }
+        }
+
+        // Splits a finished transfer into curl's phases. Transfers of one
+        // fetchAll() overlap on a single thread, so they go on async tracks
+        // (overlapping); otherwise the phases nest in the caller's span.
+        void traceTransfer(CURL *curl, Tracing::Clock::time_point started,
+                           const string &host, long status, bool overlapping) {
+            if (!Tracing::isEnabled()) {
+                return;
+            }
+            std::optional<uint64_t> asyncId;
+            if (overlapping) {
+                asyncId = Tracing::nextAsyncId();
+            }
+            // Microseconds from the start of the transfer, cumulative.
+            curl_off_t dns = 0, connect = 0, tls = 0;
+            curl_off_t pretransfer = 0, firstByte = 0, total = 0;
+            curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+            curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+            curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+            curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+            curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &firstByte);
+            curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+            struct Phase {
+                const char *name;
+                curl_off_t from;
+                curl_off_t to;
+            };
+            // A reused connection reports zero for dns, connect and tls.
+            const Phase phases[] = {
+                {"dns", 0, dns},
+                {"connect", dns, connect},
+                {"tls", connect, tls},
+                {"server", pretransfer, firstByte},
+                {"download", firstByte, total},
+            };
+            auto at = [&](curl_off_t offset) {
+                return started + std::chrono::microseconds(offset);
+            };
+
+            if (asyncId.has_value()) {
+                string args;
+                Tracing::addArg(args, "host", host);
+                Tracing::addArg(args, "status", static_cast<int64_t>(status));
+                Tracing::async("http", "net", asyncId.value(), started, at(total), args);
+            }
+            for (const Phase &phase : phases) {
+                if (phase.to <= phase.from) {
+                    continue;
+                }
+                if (asyncId.has_value()) {
+                    Tracing::async(phase.name, "net", asyncId.value(),
+                                   at(phase.from), at(phase.to));
+                } else {
+                    Tracing::complete(phase.name, "net",
+                                      at(phase.from), at(phase.to));
+                }
+            }
+        }
+
+        void releaseHandle(const string &host, CURL *curl,
+                           size_t decodedBytes) {
+            long connects = 0;
+            curl_off_t appConnect = 0;
+            curl_off_t connect = 0;
+            long status = 0;
+            curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+            curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appConnect);
+            curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+            uint64_t wireBytes = wireBytesOf(curl);
+
+            std::lock_guard<std::mutex> lock(g_poolMutex);
+            PoolStats &stats = g_poolStats[host];
+            stats.wireBytes += wireBytes;
+            stats.decodedBytes += decodedBytes;
+            if (status == 304) {
+                stats.notModified++;
+            }
+            if (connects > 0) {
+                stats.newConnections += connects;
+                // APPCONNECT is zero for plain HTTP, fall back to TCP connect.
+                stats.handshakeSeconds +=
+                    (appConnect > 0 ? appConnect : connect) / 1e6;
+            }
+
+            auto &idle = g_idleHandles[host];
+            if (idle.size() < MAX_IDLE_HANDLES_PER_HOST) {
+                idle.push_back(curl);
+            } else {
+                curl_easy_cleanup(curl);
+            }
+        }
+
+        void setCommonOptions(CURL *curl, const string &url, string *body) {
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 0L);
+            curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+            // "" offers every encoding libcurl was built with (gzip, br, ...)
+            // and decodes the response before the write callback sees it.
+            curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeFunction);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, body);
+        }
+
+        void finishTransfer(Transfer &transfer, CURLcode code,
+                            const FetchCallback &onComplete) {
+            FetchResult result;
+            result.index = transfer.index;
+            curl_easy_setopt(transfer.curl, CURLOPT_WRITEDATA, nullptr);
+            curl_easy_setopt(transfer.curl, CURLOPT_HEADERDATA, nullptr);
+            curl_easy_setopt(transfer.curl, CURLOPT_HTTPHEADER, nullptr);
+            curl_easy_setopt(transfer.curl, CURLOPT_PRIVATE, nullptr);
+            curl_slist_free_all(transfer.requestHeaders);
+            transfer.requestHeaders = nullptr;
+
+            if (code == CURLE_OK) {
+                long status = 0;
+                curl_easy_getinfo(transfer.curl, CURLINFO_RESPONSE_CODE, &status);
+                result.headers = std::move(transfer.headers);
+                result.headers.status = status;
+                result.notModified = (status == 304);
+                result.ok = (status >= 200 && status < 300) || result.notModified;
+                result.wireBytes = wireBytesOf(transfer.curl);
+                if (result.ok) {
+                    result.body = std::move(transfer.body);
+                    result.bodyHash = transfer.bodyHash.digest();
+                } else {
+                    result.error = "HTTP " + std::to_string(status);
+                }
+                recordTransfer(transfer.host, transfer.curl, result.ok,
+                               result.body.size());
+                traceTransfer(transfer.curl, transfer.started, transfer.host,
+                              status, true);
+                // The exchange completed, so the connection is reusable.
+                releaseHandle(transfer.host, transfer.curl, result.body.size());
+                LOG_INFO("HTTP " + std::to_string(status) +
+                         " response size=" + std::to_string(result.body.size()) +
+                         " wire=" + std::to_string(result.wireBytes));
+            } else {
+                result.error = curl_easy_strerror(code);
+                recordTransfer(transfer.host, transfer.curl, false, 0);
+                traceTransfer(transfer.curl, transfer.started, transfer.host,
+                              0, true);
+                curl_easy_cleanup(transfer.curl);
+                if (Log::isInitialized())
+                    Log::error("fetchAll: transfer failed: " + result.error);
+            }
+            transfer.curl = nullptr;
+            onComplete(result);
+        }
     }
 
     string urlEncode(const string &text) {
-        CURL *curl = curl_easy_init();
-        char *encoded = curl_easy_escape(curl, text.c_str(), 0);
-        string tempVariable = encoded;
-        curl_free(encoded);
-        curl_easy_cleanup(curl);
-        return tempVariable;
+        // Same output as curl_easy_escape: RFC 3986 unreserved characters
+        // are kept, every other byte becomes %XX.
+        static const char HEX_DIGITS[] = "0123456789ABCDEF";
+        string encoded;
+        encoded.reserve(text.size() * 3);
+        for (unsigned char c : text) {
+            if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+                (c >= '0' && c <= '9') ||
+                c == '-' || c == '.' || c == '_' || c == '~') {
+                encoded += static_cast<char>(c);
+            } else {
+                encoded += '%';
+                encoded += HEX_DIGITS[c >> 4];
+                encoded += HEX_DIGITS[c & 0x0F];
+            }
+        }
+        return encoded;
+    }
+
+    namespace {
+        string performRequest(const string &url, const string *postBody) {
+            DEBUG_MSG("[URL: " << url << "]");
+            LOG_INFO(string(postBody ? "HTTP POST" : "HTTP GET") +
+                     " (url length=" + std::to_string(url.size()) +
+                     (postBody ? ", body length=" +
+                         std::to_string(postBody->size()) : "") + ")");
+
+            const string host = hostFromURL(url);
+            Tracing::Span span(postBody ? "POST" : "GET", "net");
+            span.arg("host", host);
+            auto curl = acquireHandle(host);
+            string responseString;
+
+            if (!curl) {
+                if (Log::isInitialized()) Log::error("performRequest: curl_easy_init failed");
+                return "";
+            }
+
+            ResponseHeaders responseHeaders;
+            setCommonOptions(curl, url, &responseString);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerFunction);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &responseHeaders);
+
+            struct curl_slist *headers = nullptr;
+            if (postBody) {
+                headers = curl_slist_append(headers,
+                    "Content-Type: application/json");
+                curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+                // libcurl reads the body in place, no copy is made.
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postBody->data());
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                                 static_cast<curl_off_t>(postBody->size()));
+            }
+
+            auto started = Tracing::Clock::now();
+            CURLcode res = curl_easy_perform(curl);
+            // Drop the pointers into this stack frame before pooling the handle.
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, nullptr);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, nullptr);
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, nullptr);
+            curl_slist_free_all(headers);
+            if (res != CURLE_OK) {
+                if (Log::isInitialized())
+                    Log::error("performRequest: curl_easy_perform failed: " + string(curl_easy_strerror(res)));
+                recordTransfer(host, curl, false, 0);
+                traceTransfer(curl, started, host, 0, false);
+                // The connection state is unknown after a failure; do not pool it.
+                curl_easy_cleanup(curl);
+                return "";
+            }
+            LOG_INFO("HTTP " + std::to_string(responseHeaders.status) +
+                     " response size=" + std::to_string(responseString.size()));
+            recordTransfer(host, curl,
+                           responseHeaders.status >= 200 && responseHeaders.status < 300,
+                           responseString.size());
+            traceTransfer(curl, started, host, responseHeaders.status, false);
+            span.arg("status", static_cast<int64_t>(responseHeaders.status));
+            releaseHandle(host, curl, responseString.size());
+            return responseString;
+        }
     }
 
     string getJSONFromURL(const string &url) {
-        DEBUG_MSG("[URL: " << url << "]");
-        if (Log::isInitialized())
-            Log::info("HTTP GET (url length=" + std::to_string(url.size()) + ")");
-
-        auto curl = curl_easy_init();
-        string responseString;
-
-        if (!curl) {
-            if (Log::isInitialized()) Log::error("getJSONFromURL: curl_easy_init failed");
-            return "";
-        }
-
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-        curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 0L);
-        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
-
-        string headerString;
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeFunction);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseString);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headerString);
-
-        CURLcode res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            if (Log::isInitialized())
-                Log::error("getJSONFromURL: curl_easy_perform failed: " + string(curl_easy_strerror(res)));
-            curl_easy_cleanup(curl);
-            return "";
-        }
-        if (Log::isInitialized())
-            Log::info("HTTP response size=" + std::to_string(responseString.size()));
-        curl_easy_cleanup(curl);
-        return responseString;
+        return performRequest(url, nullptr);
+    }
+
+    string postJSON(const string &url, const string &body) {
+        return performRequest(url, &body);
+    }
+
+    void fetchAll(const vector<FetchRequest> &requests,
+                  size_t maxInFlight,
+                  const FetchCallback &onComplete) {
+        std::lock_guard<std::mutex> multiLock(g_multiMutex);
+        if (!g_multi) {
+            g_multi = curl_multi_init();
+        }
+        if (maxInFlight == 0) {
+            maxInFlight = 1;
+        }
+
+        vector<std::unique_ptr<Transfer>> transfers;
+        size_t nextIndex = 0;
+        size_t inFlight = 0;
+
+        // Requests waiting for the transfer of an identical one, by the
+        // index of the request that leads it.
+        vector<string> keys;
+        vector<vector<size_t>> followers(requests.size());
+        std::unordered_map<string, size_t> leaderByKey;
+        keys.reserve(requests.size());
+        for (const FetchRequest &request : requests) {
+            keys.push_back(requestKey(request));
+        }
+        // Passes a leader's result on to the requests that joined it.
+        FetchCallback complete = [&](FetchResult &result) {
+            size_t leader = result.index;
+            rememberResult(keys[leader], result);
+            // Copies first: the caller may move the body out of result.
+            for (size_t follower : followers[leader]) {
+                FetchResult copy = result;
+                copy.index = follower;
+                onComplete(copy);
+            }
+            onComplete(result);
+        };
+
+        while (nextIndex < requests.size() || inFlight > 0) {
+            while (inFlight < maxInFlight && nextIndex < requests.size()) {
+                const FetchRequest &request = requests[nextIndex];
+                const string &url = request.url;
+                const string &key = keys[nextIndex];
+                if (std::optional<FetchResult> recent = takeRecentResult(key)) {
+                    recent->index = nextIndex++;
+                    onComplete(recent.value());
+                    continue;
+                }
+                auto leader = leaderByKey.find(key);
+                if (leader != leaderByKey.end()) {
+                    followers[leader->second].push_back(nextIndex++);
+                    std::lock_guard<std::mutex> lock(g_singleFlightMutex);
+                    g_singleFlightStats.joined++;
+                    continue;
+                }
+                leaderByKey.emplace(key, nextIndex);
+                {
+                    std::lock_guard<std::mutex> lock(g_singleFlightMutex);
+                    g_singleFlightStats.transfers++;
+                }
+
+                auto transfer = std::make_unique<Transfer>();
+                transfer->index = nextIndex++;
+                transfer->host = hostFromURL(url);
+                transfer->curl = acquireHandle(transfer->host);
+
+                if (!transfer->curl || !g_multi) {
+                    if (Log::isInitialized()) Log::error("fetchAll: curl init failed");
+                    FetchResult result;
+                    result.index = transfer->index;
+                    result.error = "curl init failed";
+                    if (transfer->curl) curl_easy_cleanup(transfer->curl);
+                    complete(result);
+                    continue;
+                }
+
+                DEBUG_MSG("[URL: " << url << "]");
+                setCommonOptions(transfer->curl, url, &transfer->body);
+                curl_easy_setopt(transfer->curl, CURLOPT_WRITEFUNCTION,
+                                 transferWriteFunction);
+                curl_easy_setopt(transfer->curl, CURLOPT_WRITEDATA, transfer.get());
+                curl_easy_setopt(transfer->curl, CURLOPT_HEADERFUNCTION,
+                                 headerFunction);
+                curl_easy_setopt(transfer->curl, CURLOPT_HEADERDATA,
+                                 &transfer->headers);
+                if (!request.etag.empty()) {
+                    transfer->requestHeaders = curl_slist_append(
+                        transfer->requestHeaders,
+                        ("If-None-Match: " + request.etag).c_str());
+                }
+                if (!request.lastModified.empty()) {
+                    transfer->requestHeaders = curl_slist_append(
+                        transfer->requestHeaders,
+                        ("If-Modified-Since: " + request.lastModified).c_str());
+                }
+                if (transfer->requestHeaders) {
+                    curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER,
+                                     transfer->requestHeaders);
+                }
+                // Prefer multiplexing over an existing HTTP/2 connection to
+                // opening a parallel one to the same host.
+                curl_easy_setopt(transfer->curl, CURLOPT_PIPEWAIT, 1L);
+                curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer.get());
+                transfer->started = Tracing::Clock::now();
+                curl_multi_add_handle(g_multi, transfer->curl);
+                transfers.push_back(std::move(transfer));
+                inFlight++;
+            }
+
+            int running = 0;
+            curl_multi_perform(g_multi, &running);
+
+            CURLMsg *message;
+            int queued = 0;
+            while ((message = curl_multi_info_read(g_multi, &queued))) {
+                if (message->msg != CURLMSG_DONE) continue;
+
+                CURL *curl = message->easy_handle;
+                CURLcode code = message->data.result;
+                Transfer *transfer = nullptr;
+                curl_easy_getinfo(curl, CURLINFO_PRIVATE, &transfer);
+                curl_multi_remove_handle(g_multi, curl);
+                inFlight--;
+                if (transfer) {
+                    finishTransfer(*transfer, code, complete);
+                }
+            }
+
+            if (inFlight > 0) {
+                curl_multi_poll(g_multi, nullptr, 0, 1000, nullptr);
+            }
+        }
+    }
+
+    std::optional<string> ResponseHeaders::get(const string &lowerCaseName) const {
+        auto found = fields.find(lowerCaseName);
+        if (found == fields.end()) {
+            return std::nullopt;
+        }
+        return found->second;
+    }
+
+    void setReuseWindow(std::chrono::milliseconds window) {
+        std::lock_guard<std::mutex> lock(g_singleFlightMutex);
+        g_reuseWindow = window;
+        if (window.count() <= 0) {
+            g_recentResults.clear();
+        }
+    }
+
+    SingleFlightStats getSingleFlightStats() {
+        std::lock_guard<std::mutex> lock(g_singleFlightMutex);
+        return g_singleFlightStats;
+    }
+
+    map<string, PoolStats> getPoolStats() {
+        std::lock_guard<std::mutex> lock(g_poolMutex);
+        return g_poolStats;
+    }
+
+    void cleanupConnectionPool() {
+        {
+            std::lock_guard<std::mutex> multiLock(g_multiMutex);
+            if (g_multi) {
+                curl_multi_cleanup(g_multi);
+                g_multi = nullptr;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(g_poolMutex);
+        for (auto &entry : g_idleHandles) {
+            for (CURL *curl : entry.second) {
+                curl_easy_cleanup(curl);
+            }
+            entry.second.clear();
+        }
     }
 }
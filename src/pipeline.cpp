@@ -0,0 +1,646 @@
+#include <algorithm>
+#include "pipeline.hpp"
+#include "networking.hpp"
+#include "logging.hpp"
+#include "tracing.hpp"
+
+using namespace std;
+using namespace Kufar;
+
+namespace {
+    // The diff stage never blocks on this queue: a blocked diff could stall
+    // the parsers and, through them, the fetch stage that drains it.
+    const size_t FOLLOW_UP_CAPACITY = 1024;
+    // A lost watermark only costs one full parse, so they are saved lazily.
+    const chrono::seconds WATERMARK_SAVE_INTERVAL(60);
+}
+
+ScanPipeline::ScanPipeline(const vector<KufarConfiguration> &configurations,
+                           const vector<size_t> &tenantOfConfiguration,
+                           const vector<QueryPlan> &queryPlans,
+                           vector<Tenant> &tenants,
+                           Telegram::Sender &sender,
+                           AdaptivePolicy *adaptivePolicy,
+                           WatermarkStore *watermarks,
+                           const PipelineOptions &options)
+    : configurations(configurations), queryPlans(queryPlans),
+      tenants(tenants), sender(sender),
+      adaptivePolicy(adaptivePolicy), watermarks(watermarks), options(options),
+      pages(options.queueDepth), parsedPages(options.queueDepth),
+      followUps(FOLLOW_UP_CAPACITY), tenantShares(queryPlans.size()),
+      validators(queryPlans.size()),
+      handledBodyHash(make_unique<atomic<uint64_t>[]>(queryPlans.size())),
+      dropValidators(make_unique<atomic<bool>[]>(queryPlans.size())),
+      requestedPages(queryPlans.size(), 1),
+      newestListTime(queryPlans.size(), 0), pollBaseline(queryPlans.size(), 0),
+      stopBefore(make_unique<atomic<time_t>[]>(queryPlans.size())),
+      lastWatermarkSave(chrono::steady_clock::now()),
+      planGauges(queryPlans.size()),
+      parseDuration(Metrics::histogram("ads_parse_duration_seconds",
+          "Time parseAds() spent on one page", 1e-6)),
+      cacheHits(Metrics::counter("ads_cache_lookups_total",
+          "Seen-ad cache lookups of parsed ads", {{"result", "hit"}})),
+      cacheMisses(Metrics::counter("ads_cache_lookups_total",
+          "Seen-ad cache lookups of parsed ads", {{"result", "miss"}})) {
+    for (size_t plan = 0; plan < queryPlans.size(); plan++) {
+        // Tags repeat across tenants and filter variants; the plan hash
+        // keeps each plan's freshness apart and is stable across restarts.
+        Metrics::Labels labels = {{"query", queryPlans[plan].label},
+                                  {"plan", to_string(queryPlans[plan].hash)}};
+        planGauges[plan].lastPoll = &Metrics::gauge(
+            "ads_query_last_poll_timestamp_seconds",
+            "Unix time the first page of the query was last diffed", labels);
+        planGauges[plan].newestAd = &Metrics::gauge(
+            "ads_query_newest_ad_timestamp_seconds",
+            "List time of the newest ad the query has returned", labels);
+
+        const vector<PlanMember> &members = queryPlans[plan].members;
+        for (size_t member = 0; member < members.size(); member++) {
+            size_t tenant = tenantOfConfiguration[members[member].configuration];
+            vector<TenantShare> &shares = tenantShares[plan];
+            auto share = find_if(shares.begin(), shares.end(),
+                [&](const TenantShare &existing) { return existing.tenant == tenant; });
+            if (share == shares.end()) {
+                shares.push_back(TenantShare());
+                share = shares.end() - 1;
+                share->tenant = tenant;
+            }
+            share->members.push_back(member);
+            share->filtersLocally |= !members[member].filter.empty();
+        }
+
+        stopBefore[plan].store(0);
+        handledBodyHash[plan].store(0);
+        dropValidators[plan].store(false);
+        if (watermarks == nullptr) {
+            continue;
+        }
+        if (optional<Watermark> mark = watermarks->get(queryPlans[plan].hash)) {
+            stopBefore[plan].store(mark->listTime - options.watermarkSafetySeconds);
+        }
+    }
+}
+
+ScanPipeline::~ScanPipeline() {
+    shutdown();
+}
+
+void ScanPipeline::start() {
+    if (started) {
+        return;
+    }
+    started = true;
+    unsigned parsers = max(options.parseThreads, 1u);
+    for (unsigned i = 0; i < parsers; i++) {
+        parseThreads.emplace_back(&ScanPipeline::parseWorker, this);
+    }
+    diffThread = thread(&ScanPipeline::diffWorker, this);
+}
+
+void ScanPipeline::fetch(const vector<size_t> &plans, size_t maxInFlight) {
+    Tracing::Span span("fetch", "pipeline");
+    span.arg("plans", static_cast<int64_t>(plans.size()));
+    auto begin = chrono::steady_clock::now();
+    struct Job {
+        size_t plan;
+        int pageNumber;
+    };
+    vector<Job> jobs;
+    vector<Networking::FetchRequest> requests;
+    for (size_t plan : plans) {
+        if (dropValidators[plan].exchange(false)) {
+            validators[plan] = Validators();
+        }
+        Networking::FetchRequest request;
+        request.url = queryPlans[plan].url;
+        request.etag = validators[plan].etag;
+        request.lastModified = validators[plan].lastModified;
+        requests.push_back(std::move(request));
+        jobs.push_back({plan, 1});
+    }
+    while (optional<FollowUp> followUp = followUps.tryPop()) {
+        Networking::FetchRequest request;
+        request.url = getPageURL(queryPlans[followUp->plan], followUp->token);
+        requests.push_back(std::move(request));
+        jobs.push_back({followUp->plan, followUp->pageNumber});
+    }
+
+    uint64_t wireBytes = 0;
+    uint64_t decodedBytes = 0;
+    size_t notModified = 0;
+    Networking::fetchAll(requests, maxInFlight,
+        [&](Networking::FetchResult &result) {
+            size_t plan = jobs[result.index].plan;
+            int pageNumber = jobs[result.index].pageNumber;
+            wireBytes += result.wireBytes;
+            decodedBytes += result.body.size();
+            if (!result.ok) {
+                Log::error("Fetch failed for tag=" + queryPlans[plan].label +
+                           ": " + result.error);
+                fetchCounters.failed++;
+                return;
+            }
+            fetchCounters.processed++;
+
+            // Validators and hashes describe the first page only; later
+            // pages are reached through per-response cursors.
+            if (pageNumber > 1) {
+                FetchedPage page;
+                page.plan = plan;
+                page.pageNumber = pageNumber;
+                page.bodyHash = result.bodyHash;
+                page.body = std::move(result.body);
+                outstandingPages++;
+                pages.push(std::move(page));
+                recordDepth(parseCounters, pages.size());
+                return;
+            }
+
+            // A 304 may refresh the validators; a full response replaces them.
+            Validators &current = validators[plan];
+            optional<string> etag = result.headers.get("etag");
+            optional<string> lastModified = result.headers.get("last-modified");
+            if (!result.notModified || etag.has_value()) {
+                current.etag = etag.value_or("");
+            }
+            if (!result.notModified || lastModified.has_value()) {
+                current.lastModified = lastModified.value_or("");
+            }
+
+            if (result.notModified) {
+                notModified++;
+            }
+            if (result.notModified ||
+                handledBodyHash[plan].load() == result.bodyHash) {
+                fetchCounters.skipped++;
+                if (adaptivePolicy != nullptr) {
+                    // Still an observation: no arrivals during the interval.
+                    adaptivePolicy->observe(plan, {},
+                                            QueryScheduler::Clock::now());
+                }
+                return;
+            }
+
+            FetchedPage page;
+            page.plan = plan;
+            page.bodyHash = result.bodyHash;
+            page.body = std::move(result.body);
+            outstandingPages++;
+            // Blocks while the parsers are behind, which stalls this batch
+            // but not parsing or diffing.
+            pages.push(std::move(page));
+            recordDepth(parseCounters, pages.size());
+        });
+    recordBusy(fetchCounters, begin);
+    Log::info("Fetched " + to_string(plans.size()) + " queries and " +
+              to_string(jobs.size() - plans.size()) + " follow-up pages: wire=" +
+              to_string(wireBytes) + " bytes, decoded=" +
+              to_string(decodedBytes) + " bytes, notModified=" +
+              to_string(notModified));
+}
+
+void ScanPipeline::parseWorker() {
+    Tracing::setThreadName("parse");
+    while (optional<FetchedPage> page = pages.pop()) {
+        auto begin = chrono::steady_clock::now();
+        const QueryPlan &plan = queryPlans[page->plan];
+        Tracing::Span span("parse", "pipeline");
+        span.arg("query", plan.label);
+        span.arg("page", page->pageNumber);
+        LOG_INFO("Processing query tag=" + plan.label);
+
+        const KufarConfiguration &configuration = configurations[plan.configuration];
+        optional<time_t> cutoff;
+        time_t watermarkCutoff = stopBefore[page->plan].load(memory_order_relaxed);
+        if (watermarkCutoff > 0 && !options.backfill &&
+            isSortedByListTime(configuration)) {
+            cutoff = watermarkCutoff;
+        }
+        // Everything parseAds() reads: the body, the tag it stamps on the
+        // ads and where it stops.
+        string key = to_string(page->bodyHash) + '\n' +
+                     configuration.tag.value_or("") + '\n' +
+                     to_string(cutoff.value_or(0));
+
+        ParsedPage parsed;
+        parsed.plan = page->plan;
+        parsed.pageNumber = page->pageNumber;
+        parsed.bodyHash = page->bodyHash;
+        try {
+            bool shared = false;
+            parsed.output = parseShared(key, shared, [&] {
+                auto output = make_shared<ParseOutput>();
+                ParseOptions parseOptions;
+                parseOptions.pagination = &output->pagination;
+                parseOptions.stopBefore = cutoff;
+                auto parseBegin = chrono::steady_clock::now();
+                output->ads = parseAds(configuration, page->body, &parseOptions);
+                parseDuration.record(chrono::steady_clock::now() - parseBegin);
+                output->stoppedEarly = parseOptions.stoppedEarly;
+                return output;
+            });
+            if (shared) {
+                parseCounters.shared++;
+            }
+            LOG_INFO("getAds returned " + to_string(parsed.output->ads.size()) +
+                     " ads for tag=" + plan.label +
+                     " page=" + to_string(parsed.pageNumber) +
+                     (parsed.output->stoppedEarly ? " (stopped at watermark)" : "") +
+                     (shared ? " (shared)" : ""));
+        } catch (const exception &exc) {
+            Log::error("getAds failed for tag=" + plan.label + ": " +
+                       exc.what());
+            parseCounters.failed++;
+            if (page->pageNumber == 1) {
+                forgetFirstPage(page->plan);
+            }
+            outstandingPages--;
+            recordBusy(parseCounters, begin);
+            continue;
+        }
+        parseCounters.processed++;
+        if (parsed.output->stoppedEarly) {
+            parseCounters.skipped++;
+        }
+        recordBusy(parseCounters, begin);
+
+        parsedPages.push(std::move(parsed));
+        recordDepth(diffCounters, parsedPages.size());
+    }
+}
+
+shared_ptr<const ScanPipeline::ParseOutput> ScanPipeline::parseShared(
+        const string &key, bool &shared,
+        const function<shared_ptr<const ParseOutput>()> &parse) {
+    promise<shared_ptr<const ParseOutput>> result;
+    optional<shared_future<shared_ptr<const ParseOutput>>> inCache;
+    {
+        lock_guard<mutex> lock(parseCacheMutex);
+        auto now = chrono::steady_clock::now();
+        for (auto it = parseCache.begin(); it != parseCache.end();) {
+            bool finished = it->second.finished.has_value();
+            if (finished && now - it->second.finished.value() > options.reuseWindow) {
+                it = parseCache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        auto found = parseCache.find(key);
+        if (found != parseCache.end()) {
+            inCache = found->second.output;
+        } else {
+            parseCache[key].output = result.get_future().share();
+        }
+    }
+    if (inCache.has_value()) {
+        shared = true;
+        // Waits while another parser is still working on the same input.
+        return inCache->get();
+    }
+
+    shared = false;
+    try {
+        shared_ptr<const ParseOutput> output = parse();
+        result.set_value(output);
+        lock_guard<mutex> lock(parseCacheMutex);
+        parseCache[key].finished = chrono::steady_clock::now();
+        return output;
+    } catch (...) {
+        result.set_exception(current_exception());
+        lock_guard<mutex> lock(parseCacheMutex);
+        parseCache.erase(key);
+        throw;
+    }
+}
+
+void ScanPipeline::diffWorker() {
+    Tracing::setThreadName("diff");
+    while (optional<ParsedPage> page = parsedPages.pop()) {
+        auto begin = chrono::steady_clock::now();
+        const vector<Ad> &ads = page->output->ads;
+        Tracing::Span span("diff", "pipeline");
+        span.arg("query", queryPlans[page->plan].label);
+        span.arg("page", page->pageNumber);
+
+        if (adaptivePolicy != nullptr && page->pageNumber == 1) {
+            vector<time_t> listTimes;
+            listTimes.reserve(ads.size());
+            for (const Ad &advert : ads) {
+                listTimes.push_back(advert.date);
+            }
+            adaptivePolicy->observe(page->plan, listTimes,
+                                    QueryScheduler::Clock::now());
+        }
+
+        const QueryPlan &plan = queryPlans[page->plan];
+        time_t &baseline = pollBaseline[page->plan];
+        if (page->pageNumber == 1) {
+            baseline = newestListTime[page->plan];
+            for (const Ad &advert : ads) {
+                newestListTime[page->plan] =
+                    max(newestListTime[page->plan], advert.date);
+            }
+            planGauges[page->plan].lastPoll->set(time(nullptr));
+            planGauges[page->plan].newestAd->set(newestListTime[page->plan]);
+        }
+
+        const vector<TenantShare> &shares = tenantShares[page->plan];
+        bool lastAdWasNew;
+        if (plan.filtersLocally() || shares.size() != 1) {
+            // Ads no member wants are never recorded as seen, and tenants
+            // have seen different ads, so whether a page reached last
+            // poll's ads is judged by list time instead.
+            lastAdWasNew = baseline > 0 && !ads.empty() &&
+                           ads.back().date > baseline;
+        } else {
+            lastAdWasNew = !ads.empty() &&
+                !tenants[shares.front().tenant].seenAds.find(ads.back().id).has_value();
+        }
+
+        bool failed = false;
+        for (const TenantShare &share : shares) {
+            Tenant &tenant = tenants[share.tenant];
+            vector<Ad> wanted;
+            if (share.filtersLocally) {
+                copy_if(ads.begin(), ads.end(), back_inserter(wanted),
+                        [&](const Ad &advert) {
+                            for (size_t member : share.members) {
+                                if (plan.members[member].filter.matches(advert)) {
+                                    return true;
+                                }
+                            }
+                            return false;
+                        });
+            }
+            try {
+                unsigned sentCount =
+                    processAds(tenant, share.filtersLocally ? wanted : ads);
+                // One fsync per query batches all of its records.
+                if (sentCount > 0) {
+                    tenant.cacheJournal->sync();
+                }
+            } catch (const exception &exc) {
+                Log::error("Cache journal write failed for tenant=" +
+                           tenant.name + ": " + exc.what());
+                failed = true;
+            }
+            compactCache(tenant, false);
+        }
+        if (failed) {
+            diffCounters.failed++;
+            if (page->pageNumber == 1) {
+                forgetFirstPage(page->plan);
+            }
+        } else {
+            diffCounters.processed++;
+            if (page->pageNumber == 1) {
+                handledBodyHash[page->plan].store(page->bodyHash);
+            }
+            // Only once every tenant has recorded the ads: the next poll
+            // stops parsing at the watermark, and would never see them.
+            advanceWatermark(*page);
+        }
+        // A page cut short at the watermark already reached the ads the
+        // last poll saw; the next page would start below the cutoff.
+        queueFollowUps(*page, lastAdWasNew && !page->output->stoppedEarly);
+        saveWatermarks(false);
+        outstandingPages--;
+        recordBusy(diffCounters, begin);
+    }
+}
+
+void ScanPipeline::queueFollowUps(const ParsedPage &page, bool lastAdWasNew) {
+    int &requested = requestedPages[page.plan];
+    if (page.pageNumber == 1) {
+        requested = 1;
+    }
+    int maxPages = options.backfill ? options.backfillMaxPages
+                                    : queryPlans[page.plan].maxPages;
+    if ((!options.backfill && !lastAdWasNew) || requested >= maxPages) {
+        return;
+    }
+
+    const Pagination &pagination = page.output->pagination;
+    vector<PageToken> candidates = pagination.pages;
+    if (pagination.next.has_value()) {
+        candidates.push_back({page.pageNumber + 1, pagination.next.value()});
+    }
+    // "next" usually repeats one of the listed pages.
+    sort(candidates.begin(), candidates.end(),
+         [](const PageToken &a, const PageToken &b) { return a.number < b.number; });
+    int lastQueued = requested;
+    for (PageToken &candidate : candidates) {
+        if (candidate.number <= lastQueued || candidate.number > maxPages) {
+            continue;
+        }
+        lastQueued = candidate.number;
+        FollowUp followUp;
+        followUp.plan = page.plan;
+        followUp.pageNumber = candidate.number;
+        followUp.token = std::move(candidate.token);
+        if (!followUps.tryPush(followUp)) {
+            Log::warn("Follow-up page queue full, tag=" +
+                      queryPlans[page.plan].label + " stops at page " +
+                      to_string(requested));
+            return;
+        }
+        requested = lastQueued;
+    }
+}
+
+void ScanPipeline::advanceWatermark(const ParsedPage &page) {
+    const vector<Ad> &ads = page.output->ads;
+    if (watermarks == nullptr || ads.empty()) {
+        return;
+    }
+    const Ad *newest = &ads.front();
+    for (const Ad &advert : ads) {
+        if (advert.date > newest->date ||
+            (advert.date == newest->date && advert.id > newest->id)) {
+            newest = &advert;
+        }
+    }
+    Watermark mark;
+    mark.listTime = newest->date;
+    mark.id = newest->id;
+    if (watermarks->advance(queryPlans[page.plan].hash, mark)) {
+        stopBefore[page.plan].store(mark.listTime - options.watermarkSafetySeconds,
+                                    memory_order_relaxed);
+    }
+}
+
+void ScanPipeline::forgetFirstPage(size_t plan) {
+    handledBodyHash[plan].store(0);
+    dropValidators[plan].store(true);
+}
+
+void ScanPipeline::saveWatermarks(bool force) {
+    if (watermarks == nullptr || !watermarks->isDirty()) {
+        return;
+    }
+    auto now = chrono::steady_clock::now();
+    if (!force && now - lastWatermarkSave < WATERMARK_SAVE_INTERVAL) {
+        return;
+    }
+    lastWatermarkSave = now;
+    try {
+        watermarks->save();
+    } catch (const exception &exc) {
+        Log::error("Watermark save failed: " + string(exc.what()));
+    }
+}
+
+bool ScanPipeline::idle() const {
+    return outstandingPages.load() == 0 && followUps.size() == 0;
+}
+
+unsigned ScanPipeline::processAds(Tenant &tenant, const vector<Ad> &currentAds) {
+    unsigned sentCount = 0;
+    SeenAdStore &seenAds = tenant.seenAds;
+    CacheJournal &cacheJournal = *tenant.cacheJournal;
+
+    uint64_t hits = 0;
+    for (const auto &advert : currentAds) {
+        auto cachedPrice = seenAds.find(advert.id);
+        hits += cachedPrice.has_value();
+
+        if (options.backfill) {
+            // Record silently; a fresh deployment must not flood the chat.
+            if (cachedPrice.has_value() && advert.price >= cachedPrice.value()) {
+                continue;
+            }
+            seenAds.upsert(advert.id, advert.price);
+            cacheJournal.append(advert.id, advert.price);
+            sentCount += 1;
+            continue;
+        }
+
+        if (!cachedPrice.has_value()) {
+            Log::info("New ad: Title=" + advert.title + " ID=" + to_string(advert.id) +
+                      " Tag=" + (advert.tag.value_or("")) + " Link=" + advert.link +
+                      " Tenant=" + tenant.name);
+        } else if (advert.price <
+                   cachedPrice.value()) {
+            Log::info("Price drop: Title=" + advert.title + " ID=" + to_string(advert.id) +
+                      " Old=" + to_string(cachedPrice.value()) + " New=" + to_string(advert.price) +
+                      " Tenant=" + tenant.name);
+        } else {
+            continue;
+        }
+
+        seenAds.upsert(advert.id, advert.price);
+        cacheJournal.append(advert.id, advert.price);
+        sentCount += 1;
+
+        for (const Telegram::TelegramConfiguration &chat : tenant.chats) {
+            if (!sender.enqueue(advert, chat)) {
+                Log::error("Notification dropped, sender is shut down: ID=" +
+                           to_string(advert.id));
+            }
+        }
+    }
+    cacheHits.add(hits);
+    cacheMisses.add(currentAds.size() - hits);
+    return sentCount;
+}
+
+void ScanPipeline::compactCache(Tenant &tenant, bool force) {
+    SeenAdStore &seenAds = tenant.seenAds;
+    CacheJournal &cacheJournal = *tenant.cacheJournal;
+    if (!force && !cacheJournal.needsCompaction(seenAds)) {
+        return;
+    }
+    if (cacheJournal.recordCount() == 0) {
+        return;
+    }
+    try {
+        size_t records = cacheJournal.recordCount();
+        cacheJournal.compact(seenAds);
+        Log::info("Cache compacted for tenant=" + tenant.name + ": " +
+                  to_string(seenAds.size()) + " ads written, " +
+                  to_string(records) + " journal records folded");
+    } catch (const exception &exc) {
+        Log::error("Cache compaction failed for tenant=" + tenant.name +
+                   ": " + exc.what());
+    }
+}
+
+void ScanPipeline::shutdown() {
+    if (stopped) {
+        return;
+    }
+    stopped = true;
+
+    // Close front to back so every stage drains before its consumer stops.
+    pages.close();
+    for (thread &parser : parseThreads) {
+        if (parser.joinable()) {
+            parser.join();
+        }
+    }
+    parsedPages.close();
+    if (diffThread.joinable()) {
+        diffThread.join();
+    }
+    for (Tenant &tenant : tenants) {
+        compactCache(tenant, true);
+    }
+    saveWatermarks(true);
+}
+
+vector<StageStats> ScanPipeline::stats() const {
+    vector<StageStats> result;
+    result.push_back(makeStats("fetch", 1, fetchCounters));
+
+    StageStats parse = makeStats(
+        "parse", max(options.parseThreads, 1u), parseCounters);
+    parse.queueDepth = pages.size();
+    parse.queueCapacity = pages.capacity();
+    result.push_back(parse);
+
+    StageStats diff = makeStats("diff", 1, diffCounters);
+    diff.queueDepth = parsedPages.size();
+    diff.queueCapacity = parsedPages.capacity();
+    result.push_back(diff);
+
+    Telegram::DeliveryStats delivery = sender.stats();
+    StageStats notify;
+    notify.name = "notify";
+    notify.threads = 1;
+    notify.processed = delivery.delivered;
+    notify.failed = delivery.failed;
+    notify.queueDepth = sender.pending();
+    notify.queueCapacity = sender.capacity();
+    result.push_back(notify);
+    return result;
+}
+
+void ScanPipeline::recordDepth(StageCounters &counters, size_t depth) {
+    size_t peak = counters.peakQueueDepth.load(memory_order_relaxed);
+    while (depth > peak &&
+           !counters.peakQueueDepth.compare_exchange_weak(
+               peak, depth, memory_order_relaxed)) {
+    }
+}
+
+void ScanPipeline::recordBusy(StageCounters &counters,
+                              chrono::steady_clock::time_point since) {
+    counters.busyMicroseconds += static_cast<uint64_t>(
+        chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - since).count());
+}
+
+StageStats ScanPipeline::makeStats(const string &name, unsigned threads,
+                                   const StageCounters &counters) {
+    StageStats stats;
+    stats.name = name;
+    stats.threads = threads;
+    stats.processed = counters.processed.load(memory_order_relaxed);
+    stats.failed = counters.failed.load(memory_order_relaxed);
+    stats.skipped = counters.skipped.load(memory_order_relaxed);
+    stats.shared = counters.shared.load(memory_order_relaxed);
+    stats.peakQueueDepth = counters.peakQueueDepth.load(memory_order_relaxed);
+    stats.busySeconds =
+        counters.busyMicroseconds.load(memory_order_relaxed) / 1e6;
+    return stats;
+}
@@ -0,0 +1,194 @@
+#include <cmath>
+#include <algorithm>
+#include "scheduler.hpp"
+
+using namespace std;
+
+namespace {
+    const chrono::milliseconds MIN_INTERVAL{1000};
+
+    // Observations older than this carry 1/e of the weight of new ones.
+    const double RATE_DECAY_SECONDS = 6 * 3600;
+    // Prior worth one arrival per six hours over one hour of observation.
+    const double PRIOR_ARRIVALS = 1.0 / 6;
+    const double PRIOR_EXPOSURE_SECONDS = 3600;
+}
+
+void QueryScheduler::add(chrono::milliseconds interval,
+                         chrono::milliseconds jitter,
+                         Clock::time_point start) {
+    Query query;
+    query.interval = max(interval, MIN_INTERVAL);
+    query.jitter = max(jitter, chrono::milliseconds(0));
+    query.slot = start;
+    query.stats.query = queries.size();
+    query.stats.interval = query.interval;
+    queries.push_back(query);
+    heap.push({jittered(queries.back()), queries.size() - 1});
+}
+
+void QueryScheduler::setInterval(size_t query, chrono::milliseconds interval) {
+    queries.at(query).interval = max(interval, MIN_INTERVAL);
+    queries.at(query).stats.interval = queries.at(query).interval;
+}
+
+chrono::milliseconds QueryScheduler::interval(size_t query) const {
+    return queries.at(query).interval;
+}
+
+QueryScheduler::Clock::time_point QueryScheduler::jittered(const Query &query) {
+    if (query.jitter.count() == 0) {
+        return query.slot;
+    }
+    uniform_int_distribution<int64_t> distribution(0, query.jitter.count());
+    return query.slot + chrono::milliseconds(distribution(random));
+}
+
+vector<size_t> QueryScheduler::takeDue(Clock::time_point now) {
+    vector<size_t> due;
+    while (!heap.empty() && heap.top().due <= now) {
+        Entry entry = heap.top();
+        heap.pop();
+
+        Query &query = queries[entry.query];
+        double lag = chrono::duration<double>(now - entry.due).count();
+        query.stats.runs++;
+        query.stats.lastLagSeconds = lag;
+        query.stats.maxLagSeconds = max(query.stats.maxLagSeconds, lag);
+
+        query.slot += query.interval;
+        while (query.slot + query.interval <= now) {
+            query.slot += query.interval;
+            query.stats.missedSlots++;
+        }
+        heap.push({jittered(query), entry.query});
+        due.push_back(entry.query);
+    }
+    return due;
+}
+
+QueryScheduler::Clock::time_point QueryScheduler::nextDue() const {
+    return heap.empty() ? Clock::time_point::max() : heap.top().due;
+}
+
+vector<QueryScheduler::QueryStats> QueryScheduler::stats() const {
+    vector<QueryStats> result;
+    result.reserve(queries.size());
+    for (const Query &query : queries) {
+        result.push_back(query.stats);
+    }
+    return result;
+}
+
+AdaptivePolicy::AdaptivePolicy(double requestsPerMinute,
+                               chrono::seconds minInterval,
+                               chrono::seconds maxInterval)
+    : requestsPerSecond(max(requestsPerMinute, 1e-3) / 60),
+      minIntervalSeconds(max<double>(minInterval.count(), 1)),
+      maxIntervalSeconds(max<double>(maxInterval.count(),
+                                     minInterval.count())) {}
+
+void AdaptivePolicy::resize(size_t count) {
+    lock_guard<mutex> lock(estimatesMutex);
+    estimates.resize(count);
+}
+
+void AdaptivePolicy::observe(size_t query, const vector<time_t> &listTimes,
+                             QueryScheduler::Clock::time_point now) {
+    lock_guard<mutex> lock(estimatesMutex);
+    Estimate &estimate = estimates.at(query);
+    time_t newest = estimate.newestListTime;
+    size_t arrivals = 0;
+    for (time_t listTime : listTimes) {
+        if (listTime > estimate.newestListTime) {
+            arrivals++;
+        }
+        newest = max(newest, listTime);
+    }
+
+    // The first poll only establishes which ads already existed.
+    if (estimate.hasBaseline) {
+        // Pipelined polls may be observed slightly out of order.
+        double elapsed = max(
+            chrono::duration<double>(now - estimate.lastPoll).count(), 0.0);
+        double weight = exp(-elapsed / RATE_DECAY_SECONDS);
+        estimate.arrivals = estimate.arrivals * weight + arrivals;
+        estimate.exposureSeconds = estimate.exposureSeconds * weight + elapsed;
+    }
+    estimate.hasBaseline = true;
+    estimate.newestListTime = newest;
+    estimate.lastPoll = now;
+}
+
+double AdaptivePolicy::rate(const Estimate &estimate) const {
+    return (estimate.arrivals + PRIOR_ARRIVALS) /
+           (estimate.exposureSeconds + PRIOR_EXPOSURE_SECONDS);
+}
+
+vector<AdaptivePolicy::QueryEstimate> AdaptivePolicy::allocate() const {
+    lock_guard<mutex> lock(estimatesMutex);
+    const size_t count = estimates.size();
+    vector<double> weights(count);
+    vector<double> frequencies(count, 0);
+    vector<bool> fixed(count, false);
+    for (size_t i = 0; i < count; i++) {
+        weights[i] = sqrt(rate(estimates[i]));
+    }
+
+    // Water-filling: every round splits the budget left by earlier rounds
+    // among the unpinned queries. Queries above the upper bound are pinned
+    // first, since that frees budget for the others; queries below the
+    // lower bound are only pinned once no share exceeds the upper bound.
+    double budget = requestsPerSecond;
+    const double highest = 1 / minIntervalSeconds;
+    const double lowest = 1 / maxIntervalSeconds;
+    for (size_t round = 0; round < count; round++) {
+        double weightSum = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!fixed[i]) weightSum += weights[i];
+        }
+        if (weightSum <= 0) {
+            break;
+        }
+
+        const double share = max(budget, 0.0) / weightSum;
+        bool tooHigh = false;
+        bool tooLow = false;
+        for (size_t i = 0; i < count; i++) {
+            if (fixed[i]) continue;
+            frequencies[i] = share * weights[i];
+            tooHigh = tooHigh || frequencies[i] > highest;
+            tooLow = tooLow || frequencies[i] < lowest;
+        }
+        if (!tooHigh && !tooLow) {
+            break;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (fixed[i]) continue;
+            if (tooHigh && frequencies[i] > highest) {
+                frequencies[i] = highest;
+            } else if (!tooHigh && frequencies[i] < lowest) {
+                frequencies[i] = lowest;
+            } else {
+                continue;
+            }
+            fixed[i] = true;
+            budget -= frequencies[i];
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        frequencies[i] = min(max(frequencies[i], lowest), highest);
+    }
+
+    vector<QueryEstimate> result(count);
+    for (size_t i = 0; i < count; i++) {
+        double interval = 1 / frequencies[i];
+        result[i].query = i;
+        result[i].arrivalsPerHour = rate(estimates[i]) * 3600;
+        result[i].interval = chrono::milliseconds(
+            static_cast<int64_t>(interval * 1000));
+        result[i].expectedDelaySeconds = interval / 2;
+    }
+    return result;
+}
@@ -0,0 +1,117 @@
+#include "seenadstore.hpp"
+
+using namespace std;
+
+namespace {
+    const size_t MIN_SLOT_COUNT = 16;
+
+    // Fibonacci hashing spreads sequential Kufar ids over the table.
+    inline size_t hashId(int id, size_t mask) {
+        uint64_t h = static_cast<uint32_t>(id) * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>(h >> 32) & mask;
+    }
+}
+
+SeenAdStore::SeenAdStore(const vector<AdPrice> &entries) {
+    reserve(entries.size());
+    for (const auto &entry : entries) {
+        upsert(entry.id, entry.price);
+    }
+}
+
+size_t SeenAdStore::slotFor(int id) const {
+    const size_t mask = slots.size() - 1;
+    size_t slot = hashId(id, mask);
+    while (slots[slot] != EMPTY_SLOT &&
+           items[slots[slot] - 1].id != id) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+optional<int> SeenAdStore::find(int id) const {
+    if (!slots.empty()) {
+        uint32_t index = slots[slotFor(id)];
+        if (index != EMPTY_SLOT) {
+            return items[index - 1].price;
+        }
+    }
+    if (base) {
+        return base->find(id);
+    }
+    return nullopt;
+}
+
+bool SeenAdStore::upsert(int id, int price) {
+    // Keep the load factor at or below 1/2 so probe chains stay short.
+    if ((items.size() + 1) * 2 > slots.size()) {
+        rehash(max(MIN_SLOT_COUNT, slots.size() * 2));
+    }
+
+    size_t slot = slotFor(id);
+    if (slots[slot] != EMPTY_SLOT) {
+        items[slots[slot] - 1].price = price;
+        return false;
+    }
+
+    items.push_back({id, price});
+    slots[slot] = static_cast<uint32_t>(items.size());
+    if (base && base->find(id).has_value()) {
+        return false;
+    }
+    idsMissingFromBase++;
+    return true;
+}
+
+void SeenAdStore::reserve(size_t count) {
+    items.reserve(count);
+    size_t slotCount = MIN_SLOT_COUNT;
+    while (slotCount < count * 2) {
+        slotCount *= 2;
+    }
+    if (slotCount > slots.size()) {
+        rehash(slotCount);
+    }
+}
+
+void SeenAdStore::clear() {
+    items.clear();
+    slots.clear();
+    base.reset();
+    idsMissingFromBase = 0;
+}
+
+void SeenAdStore::rebase(shared_ptr<const MappedCache> newBase) {
+    items.clear();
+    slots.clear();
+    idsMissingFromBase = 0;
+    base = std::move(newBase);
+}
+
+vector<AdPrice> SeenAdStore::snapshot() const {
+    vector<AdPrice> result;
+    result.reserve(size());
+    if (base) {
+        for (const AdPrice &entry : *base) {
+            result.push_back({entry.id, find(entry.id).value()});
+        }
+    }
+    for (const AdPrice &entry : items) {
+        if (!base || !base->find(entry.id).has_value()) {
+            result.push_back(entry);
+        }
+    }
+    return result;
+}
+
+void SeenAdStore::rehash(size_t slotCount) {
+    slots.assign(slotCount, EMPTY_SLOT);
+    const size_t mask = slotCount - 1;
+    for (size_t i = 0; i < items.size(); i++) {
+        size_t slot = hashId(items[i].id, mask);
+        while (slots[slot] != EMPTY_SLOT) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = static_cast<uint32_t>(i + 1);
+    }
+}
@@ -2,6 +2,11 @@
 #include "kufar.hpp"
 #include "telegram.hpp"
 #include "networking.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
+#include "helperfunctions.hpp"
+#include "timestamp.hpp"
 #include <nlohmann/json.hpp> 
 
 namespace Telegram {
@@ -10,7 +15,7 @@ namespace Telegram {
     using nlohmann::json;
 
     const short int MAX_IMAGES_IN_GROUP = 10;
-    string makeImageGroupJSON(
+    json makeImageGroupJSON(
         const vector<string> &images,
         const string &caption) {
         json j_array = json::array();
@@ -25,14 +30,45 @@ namespace Telegram {
             }
             j_array.push_back(j_list);
         }
-        return j_array.dump();
+        return j_array;
     }
 
-    void sendAdvert(
+    DeliveryResult parseDeliveryResult(const string &response) {
+        DeliveryResult result;
+        if (response.empty()) {
+            result.retryable = true;
+            result.description = "no response";
+            return result;
+        }
+
+        json j = json::parse(response, nullptr, false);
+        if (j.is_discarded() || !j.is_object()) {
+            result.retryable = true;
+            result.description = "malformed response";
+            return result;
+        }
+
+        result.ok = getOptionalValue<bool>(j, "ok").value_or(false);
+        result.errorCode = getOptionalValue<int>(j, "error_code");
+        result.description =
+            getOptionalValue<string>(j, "description").value_or("");
+        if (j.contains("parameters")) {
+            result.retryAfterSeconds =
+                getOptionalValue<int>(j.at("parameters"), "retry_after");
+        }
+        if (!result.ok && result.errorCode.has_value()) {
+            result.retryable = result.errorCode.value() >= 500;
+        }
+        return result;
+    }
+
+    DeliveryResult sendAdvert(
         const TelegramConfiguration &telegramConfiguration,
         const Kufar::Ad &ad) {
-        string formattedTime = ctime(&ad.date);
-        formattedTime.pop_back();
+        Tracing::Span span("sendAdvert", "telegram");
+        span.arg("ad", static_cast<int64_t>(ad.id));
+        string formattedTime = Timestamp::format(
+            ad.date, telegramConfiguration.utcOffsetMinutes);
         string text = "";
 
         if (ad.tag.has_value()) {
@@ -60,20 +96,252 @@ namespace Telegram {
             text += "\nCity, Region: " + location;
         }
 
-        string url = "https://api.telegram.org/bot" +
+        string url = telegramConfiguration.apiURL + "/bot" +
                         telegramConfiguration.botToken;
+        json request = {{"chat_id", telegramConfiguration.chatID}};
         if (!ad.images.empty()) {
-            url += "/sendMediaGroup?chat_id=" +
-                to_string(telegramConfiguration.chatID) +
-                "&media=" +
-                urlEncode(
-                    makeImageGroupJSON(ad.images, text));
+            url += "/sendMediaGroup";
+            request["media"] = makeImageGroupJSON(ad.images, text);
         } else {
-            url += "/sendPhoto?chat_id=" +
-                to_string(telegramConfiguration.chatID) +
-                "&caption=" + urlEncode(text) +
-                "&photo=https://via.placeholder.com/1080";
+            url += "/sendPhoto";
+            request["caption"] = text;
+            request["photo"] = "https://via.placeholder.com/1080";
+        }
+
+        return parseDeliveryResult(postJSON(url, request.dump()));
+    }
+
+    namespace {
+        // Bot API limits: https://core.telegram.org/bots/faq
+        const double GLOBAL_MESSAGES_PER_SECOND = 30;
+        const double PRIVATE_CHAT_MESSAGES_PER_SECOND = 1;
+        const double GROUP_CHAT_MESSAGES_PER_SECOND = 20.0 / 60;
+        const double GROUP_CHAT_BURST = 20;
+
+        double secondsBetween(chrono::steady_clock::time_point from,
+                              chrono::steady_clock::time_point to) {
+            return chrono::duration<double>(to - from).count();
+        }
+
+        // Messages Telegram counts against its limits for one advert.
+        double messageCost(const Kufar::Ad &ad) {
+            return max<double>(1, min<size_t>(ad.images.size(), MAX_IMAGES_IN_GROUP));
+        }
+
+        Metrics::Counter &notificationCounter(const string &result) {
+            return Metrics::counter("ads_notifications_total",
+                "Telegram notifications by outcome of each attempt",
+                {{"result", result}});
+        }
+    }
+
+    constexpr chrono::seconds Sender::DRAIN_TIMEOUT;
+
+    Sender::Sender(const TelegramConfiguration &configuration,
+                   size_t queueCapacity)
+        : configuration(configuration), queue(queueCapacity) {}
+
+    Sender::~Sender() {
+        shutdown();
+    }
+
+    void Sender::start() {
+        if (!worker.joinable()) {
+            worker = thread(&Sender::run, this);
+        }
+    }
+
+    bool Sender::enqueue(const Kufar::Ad &ad) {
+        return enqueue(ad, configuration);
+    }
+
+    bool Sender::enqueue(const Kufar::Ad &ad,
+                         const TelegramConfiguration &destination) {
+        Delivery delivery;
+        delivery.ad = ad;
+        delivery.destination = destination;
+        delivery.enqueuedAt = Clock::now();
+        delivery.readyAt = delivery.enqueuedAt;
+
+        if (queue.tryPush(delivery)) {
+            return true;
+        }
+        Log::warn("Notification queue full (" +
+                  to_string(queue.capacity()) + "), waiting for sender");
+        return queue.push(std::move(delivery));
+    }
+
+    void Sender::shutdown() {
+        queue.close();
+        if (worker.joinable()) {
+            if (queue.size() > 0) {
+                Log::info("Draining " + to_string(queue.size()) +
+                          " queued notifications");
+            }
+            worker.join();
+            DeliveryStats final = stats();
+            Log::info("Sender stopped: delivered=" + to_string(final.delivered) +
+                      " failed=" + to_string(final.failed) +
+                      " throttled=" + to_string(final.throttled));
+        }
+    }
+
+    DeliveryStats Sender::stats() const {
+        lock_guard<mutex> lock(statsMutex);
+        return deliveryStats;
+    }
+
+    TokenBucket &Sender::botBucket(const string &botToken) {
+        auto it = botBuckets.find(botToken);
+        if (it == botBuckets.end()) {
+            it = botBuckets.emplace(botToken, TokenBucket(
+                GLOBAL_MESSAGES_PER_SECOND, GLOBAL_MESSAGES_PER_SECOND)).first;
         }
-        getJSONFromURL(url);
+        return it->second;
+    }
+
+    TokenBucket &Sender::chatBucket(const TelegramConfiguration &destination) {
+        auto key = make_pair(destination.botToken, destination.chatID);
+        auto it = chatBuckets.find(key);
+        if (it == chatBuckets.end()) {
+            // Group and channel ids are negative.
+            bool isGroup = destination.chatID < 0;
+            it = chatBuckets.emplace(key, isGroup
+                ? TokenBucket(GROUP_CHAT_MESSAGES_PER_SECOND, GROUP_CHAT_BURST)
+                : TokenBucket(PRIVATE_CHAT_MESSAGES_PER_SECOND, 1)).first;
+        }
+        return it->second;
+    }
+
+    void Sender::schedule(Delivery delivery) {
+        delivery.sequence = nextSequence++;
+        scheduled.push(std::move(delivery));
+    }
+
+    void Sender::run() {
+        Tracing::setThreadName("telegram");
+        optional<Clock::time_point> drainDeadline;
+
+        while (true) {
+            if (scheduled.empty()) {
+                optional<Delivery> delivery = queue.pop();
+                if (!delivery.has_value()) {
+                    break;
+                }
+                schedule(std::move(delivery.value()));
+            }
+            while (optional<Delivery> delivery = queue.tryPop()) {
+                schedule(std::move(delivery.value()));
+            }
+
+            const Delivery &next = scheduled.top();
+            Clock::time_point now = Clock::now();
+            double cost = messageCost(next.ad);
+            Clock::time_point sendAt = max({
+                next.readyAt,
+                botBucket(next.destination.botToken).readyAt(now, cost),
+                chatBucket(next.destination).readyAt(now, cost)});
+
+            if (queue.isClosed() && !drainDeadline.has_value()) {
+                drainDeadline = now + DRAIN_TIMEOUT;
+            }
+            if (drainDeadline.has_value() && sendAt > drainDeadline.value()) {
+                Log::warn("Dropping " + to_string(scheduled.size()) +
+                          " throttled notifications on shutdown");
+                lock_guard<mutex> lock(statsMutex);
+                deliveryStats.failed += scheduled.size();
+                break;
+            }
+
+            if (sendAt > now) {
+                // Wake up early if new work arrives; it may be due sooner.
+                optional<Delivery> delivery = queue.popFor(sendAt - now);
+                if (delivery.has_value()) {
+                    schedule(std::move(delivery.value()));
+                } else if (queue.isClosed()) {
+                    this_thread::sleep_until(sendAt);
+                }
+                continue;
+            }
+
+            Delivery delivery = next;
+            scheduled.pop();
+            deliver(std::move(delivery));
+        }
+    }
+
+    void Sender::deliver(Delivery delivery) {
+        static Metrics::Counter &sent = notificationCounter("sent");
+        static Metrics::Counter &throttled = notificationCounter("throttled");
+        static Metrics::Counter &retried = notificationCounter("retried");
+        static Metrics::Counter &failed = notificationCounter("failed");
+        static Metrics::Histogram &latencyHistogram = Metrics::histogram(
+            "ads_notification_latency_seconds",
+            "Time from queueing a notification to Telegram accepting it", 1e-6);
+
+        Clock::time_point now = Clock::now();
+        double cost = messageCost(delivery.ad);
+        botBucket(delivery.destination.botToken).take(now, cost);
+        chatBucket(delivery.destination).take(now, cost);
+        delivery.attempts++;
+
+        DeliveryResult result;
+        try {
+            result = sendAdvert(delivery.destination, delivery.ad);
+        } catch (const exception &exc) {
+            result.description = exc.what();
+        }
+
+        now = Clock::now();
+        lock_guard<mutex> lock(statsMutex);
+        if (result.ok) {
+            double latency = secondsBetween(delivery.enqueuedAt, now);
+            sent.add();
+            latencyHistogram.record(now - delivery.enqueuedAt);
+            deliveryStats.delivered++;
+            deliveryStats.totalLatencySeconds += latency;
+            deliveryStats.maxLatencySeconds =
+                max(deliveryStats.maxLatencySeconds, latency);
+            return;
+        }
+
+        if (result.retryAfterSeconds.has_value()) {
+            int retryAfter = max(1, result.retryAfterSeconds.value());
+            throttled.add();
+            deliveryStats.throttled++;
+            // The chat is paused either way so other messages back off too.
+            chatBucket(delivery.destination).pauseUntil(
+                now + chrono::seconds(retryAfter));
+            if (++delivery.throttledAttempts >= MAX_THROTTLED_ATTEMPTS) {
+                failed.add();
+                deliveryStats.failed++;
+                Log::error("sendAdvert gave up after " +
+                           to_string(delivery.throttledAttempts) +
+                           " throttled attempts: ID=" + to_string(delivery.ad.id));
+                return;
+            }
+            Log::warn("Telegram throttled chat " + to_string(delivery.destination.chatID) +
+                      ", retry after " + to_string(retryAfter) + "s");
+            delivery.readyAt = now + chrono::seconds(retryAfter);
+            schedule(std::move(delivery));
+            return;
+        }
+
+        if (result.retryable && delivery.attempts < MAX_ATTEMPTS) {
+            retried.add();
+            deliveryStats.retried++;
+            auto backoff = chrono::seconds(1 << delivery.attempts);
+            Log::warn("sendAdvert failed (" + result.description +
+                      "), retrying in " + to_string(backoff.count()) + "s");
+            delivery.readyAt = now + backoff;
+            schedule(std::move(delivery));
+            return;
+        }
+
+        failed.add();
+        deliveryStats.failed++;
+        Log::error("sendAdvert failed: ID=" + to_string(delivery.ad.id) +
+                   " code=" + to_string(result.errorCode.value_or(0)) +
+                   " " + result.description);
     }
 };
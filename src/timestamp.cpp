@@ -0,0 +1,41 @@
+#include "timestamp.hpp"
+
+#include <cstdio>
+
+using namespace std;
+
+namespace Timestamp {
+    string format(time_t timestamp, int utcOffsetMinutes) {
+        static const char *const WEEKDAYS[] =
+            {"Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"};
+        static const char *const MONTHS[] =
+            {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+             "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+        int64_t local = static_cast<int64_t>(timestamp) +
+                        static_cast<int64_t>(utcOffsetMinutes) * 60;
+        int64_t days = local / 86400;
+        int64_t secondOfDay = local % 86400;
+        if (secondOfDay < 0) {
+            secondOfDay += 86400;
+            days -= 1;
+        }
+        // 1970-01-01 was a Thursday.
+        int64_t weekday = days % 7;
+        if (weekday < 0) {
+            weekday += 7;
+        }
+        CivilDate date = civilFromDays(days);
+
+        char buffer[64];
+        int length = snprintf(buffer, sizeof(buffer),
+                              "%s %s %2u %02d:%02d:%02d %lld",
+                              WEEKDAYS[weekday], MONTHS[date.month - 1],
+                              date.day,
+                              static_cast<int>(secondOfDay / 3600),
+                              static_cast<int>(secondOfDay / 60 % 60),
+                              static_cast<int>(secondOfDay % 60),
+                              static_cast<long long>(date.year));
+        return string(buffer, length > 0 ? static_cast<size_t>(length) : 0);
+    }
+}
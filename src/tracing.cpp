@@ -0,0 +1,223 @@
+#include <mutex>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <cstdio>
+#include <unistd.h>
+#include "tracing.hpp"
+#include "helperfunctions.hpp"
+
+using namespace std;
+
+namespace Tracing {
+    namespace detail {
+        atomic<bool> enabled{false};
+    }
+
+    namespace {
+        // Per thread; at roughly 100 bytes an event this bounds a busy
+        // thread to a couple of MB and still covers many scan batches.
+        const size_t EVENTS_PER_THREAD = 16384;
+
+        struct Event {
+            const char *name = "";
+            const char *category = "";
+            char phase = 'X';
+            uint64_t id = 0;
+            int64_t timestamp = 0;  // Microseconds since g_epoch
+            int64_t duration = 0;
+            string args;
+        };
+
+        struct ThreadBuffer {
+            mutex lock;
+            uint32_t tid = 0;
+            string name;
+            vector<Event> events;
+            // Oldest event once the buffer has wrapped.
+            size_t next = 0;
+        };
+
+        const Clock::time_point g_epoch = Clock::now();
+        mutex g_buffersMutex;
+        // Buffers outlive their threads so a dump still shows them.
+        vector<shared_ptr<ThreadBuffer>> g_buffers;
+        atomic<uint64_t> g_asyncIds{0};
+        atomic<bool> g_dumpRequested{false};
+        thread_local shared_ptr<ThreadBuffer> t_buffer;
+
+        ThreadBuffer &localBuffer() {
+            if (!t_buffer) {
+                t_buffer = make_shared<ThreadBuffer>();
+                lock_guard<mutex> lock(g_buffersMutex);
+                t_buffer->tid = static_cast<uint32_t>(g_buffers.size() + 1);
+                g_buffers.push_back(t_buffer);
+            }
+            return *t_buffer;
+        }
+
+        int64_t sinceEpoch(Clock::time_point time) {
+            return chrono::duration_cast<chrono::microseconds>(time - g_epoch).count();
+        }
+
+        void record(Event &&event) {
+            ThreadBuffer &buffer = localBuffer();
+            lock_guard<mutex> lock(buffer.lock);
+            if (buffer.events.size() < EVENTS_PER_THREAD) {
+                buffer.events.push_back(std::move(event));
+                return;
+            }
+            buffer.events[buffer.next] = std::move(event);
+            buffer.next = (buffer.next + 1) % EVENTS_PER_THREAD;
+        }
+
+        void appendEscaped(string &out, const string &text) {
+            for (unsigned char c : text) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                    out += static_cast<char>(c);
+                } else if (c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += static_cast<char>(c);
+                }
+            }
+        }
+
+        void appendEvent(string &out, const Event &event, long pid, uint32_t tid) {
+            out += "{\"name\":\"";
+            appendEscaped(out, event.name);
+            out += "\",\"cat\":\"";
+            appendEscaped(out, event.category);
+            out += "\",\"ph\":\"";
+            out += event.phase;
+            out += "\",\"ts\":" + to_string(event.timestamp);
+            if (event.phase == 'X') {
+                out += ",\"dur\":" + to_string(event.duration);
+            } else {
+                out += ",\"id\":" + to_string(event.id);
+            }
+            out += ",\"pid\":" + to_string(pid) + ",\"tid\":" + to_string(tid);
+            if (!event.args.empty()) {
+                out += ",\"args\":{" + event.args + '}';
+            }
+            out += '}';
+        }
+    }
+
+    void enable() {
+        detail::enabled.store(true, memory_order_relaxed);
+    }
+
+    void setThreadName(const string &name) {
+        ThreadBuffer &buffer = localBuffer();
+        lock_guard<mutex> lock(buffer.lock);
+        buffer.name = name;
+    }
+
+    void complete(const char *name, const char *category,
+                  Clock::time_point begin, Clock::time_point end,
+                  const string &args) {
+        if (!isEnabled()) {
+            return;
+        }
+        Event event;
+        event.name = name;
+        event.category = category;
+        event.timestamp = sinceEpoch(begin);
+        event.duration = max<int64_t>(0, sinceEpoch(end) - event.timestamp);
+        event.args = args;
+        record(std::move(event));
+    }
+
+    void async(const char *name, const char *category, uint64_t id,
+               Clock::time_point begin, Clock::time_point end,
+               const string &args) {
+        if (!isEnabled()) {
+            return;
+        }
+        Event event;
+        event.name = name;
+        event.category = category;
+        event.phase = 'b';
+        event.id = id;
+        event.timestamp = sinceEpoch(begin);
+        event.args = args;
+        Event ending = event;
+        ending.phase = 'e';
+        ending.timestamp = max(sinceEpoch(end), event.timestamp);
+        ending.args.clear();
+        record(std::move(event));
+        record(std::move(ending));
+    }
+
+    uint64_t nextAsyncId() {
+        return g_asyncIds.fetch_add(1, memory_order_relaxed) + 1;
+    }
+
+    void addArg(string &args, const char *key, const string &value) {
+        if (!args.empty()) {
+            args += ',';
+        }
+        args += '"';
+        args += key;
+        args += "\":\"";
+        appendEscaped(args, value);
+        args += '"';
+    }
+
+    void addArg(string &args, const char *key, int64_t value) {
+        if (!args.empty()) {
+            args += ',';
+        }
+        args += '"';
+        args += key;
+        args += "\":";
+        args += to_string(value);
+    }
+
+    void requestDump() {
+        g_dumpRequested.store(true);
+    }
+
+    bool dumpRequested() {
+        return g_dumpRequested.exchange(false);
+    }
+
+    size_t dump(const string &path) {
+        vector<shared_ptr<ThreadBuffer>> buffers;
+        {
+            lock_guard<mutex> lock(g_buffersMutex);
+            buffers = g_buffers;
+        }
+
+        long pid = static_cast<long>(getpid());
+        size_t written = 0;
+        string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (const auto &buffer : buffers) {
+            lock_guard<mutex> lock(buffer->lock);
+            if (buffer != buffers.front()) {
+                out += ',';
+            }
+            out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" +
+                   to_string(pid) + ",\"tid\":" + to_string(buffer->tid) +
+                   ",\"args\":{\"name\":\"";
+            appendEscaped(out, buffer->name.empty()
+                ? "thread-" + to_string(buffer->tid) : buffer->name);
+            out += "\"}}";
+            // Oldest first; next is 0 until the buffer wraps.
+            size_t count = buffer->events.size();
+            for (size_t i = 0; i < count; i++) {
+                out += ',';
+                appendEvent(out, buffer->events[(buffer->next + i) % count],
+                            pid, buffer->tid);
+            }
+            written += count;
+        }
+        out += "]}\n";
+        saveFileAtomically(path, out);
+        return written;
+    }
+};
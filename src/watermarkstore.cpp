@@ -0,0 +1,67 @@
+#include <fstream>
+#include <stdexcept>
+#include <nlohmann/json.hpp>
+#include "watermarkstore.hpp"
+#include "helperfunctions.hpp"
+
+using namespace std;
+using nlohmann::json;
+
+WatermarkStore::WatermarkStore(const string &path) : filePath(path) {}
+
+void WatermarkStore::load() {
+    marks.clear();
+    dirty = false;
+    if (!fileExists(filePath)) {
+        return;
+    }
+
+    ifstream ifs(filePath);
+    try {
+        json contents = json::parse(ifs);
+        for (const auto &entry : contents.items()) {
+            Watermark mark;
+            mark.listTime = entry.value().at("list-time").get<time_t>();
+            mark.id = entry.value().at("id").get<int>();
+            marks[stoull(entry.key())] = mark;
+        }
+    } catch (const exception &exc) {
+        marks.clear();
+        throw runtime_error("cannot parse \"" + filePath + "\": " + exc.what());
+    }
+}
+
+void WatermarkStore::save() {
+    if (!dirty) {
+        return;
+    }
+    json contents = json::object();
+    for (const auto &entry : marks) {
+        contents[to_string(entry.first)] = {
+            {"list-time", entry.second.listTime},
+            {"id", entry.second.id}
+        };
+    }
+    saveFileAtomically(filePath, contents.dump(4));
+    dirty = false;
+}
+
+optional<Watermark> WatermarkStore::get(uint64_t query) const {
+    auto found = marks.find(query);
+    if (found == marks.end()) {
+        return nullopt;
+    }
+    return found->second;
+}
+
+bool WatermarkStore::advance(uint64_t query, const Watermark &mark) {
+    auto found = marks.find(query);
+    if (found != marks.end() &&
+        (mark.listTime < found->second.listTime ||
+         (mark.listTime == found->second.listTime && mark.id <= found->second.id))) {
+        return false;
+    }
+    marks[query] = mark;
+    dirty = true;
+    return true;
+}
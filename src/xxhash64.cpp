@@ -0,0 +1,122 @@
+#include <cstring>
+#include "xxhash64.hpp"
+
+namespace {
+    const uint64_t PRIME1 = 11400714785074694791ull;
+    const uint64_t PRIME2 = 14029467366897019727ull;
+    const uint64_t PRIME3 = 1609587929392839161ull;
+    const uint64_t PRIME4 = 9650029242287828579ull;
+    const uint64_t PRIME5 = 2870177450012600261ull;
+
+    inline uint64_t rotateLeft(uint64_t value, int bits) {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    // Little-endian loads; memcpy compiles to a single mov.
+    inline uint64_t read64(const unsigned char *p) {
+        uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline uint32_t read32(const unsigned char *p) {
+        uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline uint64_t round(uint64_t accumulator, uint64_t input) {
+        accumulator += input * PRIME2;
+        return rotateLeft(accumulator, 31) * PRIME1;
+    }
+
+    inline uint64_t mergeRound(uint64_t hash, uint64_t accumulator) {
+        hash ^= round(0, accumulator);
+        return hash * PRIME1 + PRIME4;
+    }
+}
+
+XXHash64::XXHash64(uint64_t seed) : seed(seed) {
+    accumulators[0] = seed + PRIME1 + PRIME2;
+    accumulators[1] = seed + PRIME2;
+    accumulators[2] = seed;
+    accumulators[3] = seed - PRIME1;
+}
+
+void XXHash64::update(const void *data, size_t length) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    const unsigned char *end = p + length;
+    totalLength += length;
+
+    if (buffered + length < sizeof(buffer)) {
+        std::memcpy(buffer + buffered, p, length);
+        buffered += length;
+        return;
+    }
+
+    if (buffered > 0) {
+        size_t fill = sizeof(buffer) - buffered;
+        std::memcpy(buffer + buffered, p, fill);
+        for (int lane = 0; lane < 4; lane++) {
+            accumulators[lane] = round(accumulators[lane],
+                                       read64(buffer + lane * 8));
+        }
+        p += fill;
+        buffered = 0;
+    }
+
+    while (p + 32 <= end) {
+        for (int lane = 0; lane < 4; lane++) {
+            accumulators[lane] = round(accumulators[lane], read64(p + lane * 8));
+        }
+        p += 32;
+    }
+
+    buffered = static_cast<size_t>(end - p);
+    std::memcpy(buffer, p, buffered);
+}
+
+uint64_t XXHash64::digest() const {
+    uint64_t hash;
+    if (totalLength >= 32) {
+        hash = rotateLeft(accumulators[0], 1) + rotateLeft(accumulators[1], 7) +
+               rotateLeft(accumulators[2], 12) + rotateLeft(accumulators[3], 18);
+        for (int lane = 0; lane < 4; lane++) {
+            hash = mergeRound(hash, accumulators[lane]);
+        }
+    } else {
+        hash = seed + PRIME5;
+    }
+    hash += totalLength;
+
+    const unsigned char *p = buffer;
+    const unsigned char *end = buffer + buffered;
+    while (p + 8 <= end) {
+        hash ^= round(0, read64(p));
+        hash = rotateLeft(hash, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        hash ^= static_cast<uint64_t>(read32(p)) * PRIME1;
+        hash = rotateLeft(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        hash ^= (*p) * PRIME5;
+        hash = rotateLeft(hash, 11) * PRIME1;
+        p++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t XXHash64::hash(const void *data, size_t length, uint64_t seed) {
+    XXHash64 state(seed);
+    state.update(data, length);
+    return state.digest();
+}
@@ -0,0 +1,206 @@
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <curl/curl.h>
+
+#include "pipeline.hpp"
+#include "networking.hpp"
+#include "helperfunctions.hpp"
+
+using namespace std;
+
+namespace {
+    int g_failures = 0;
+
+    void check(bool condition, const char *expression, const char *file, int line) {
+        if (!condition) {
+            fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+            g_failures++;
+        }
+    }
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+    /** Answers every request on 127.0.0.1 with the current body. */
+    class StubServer {
+    public:
+        StubServer() {
+            listener = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t length = sizeof(address);
+            if (listener < 0 ||
+                bind(listener, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+                listen(listener, 16) != 0 ||
+                getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+                perror("stub server");
+                exit(EXIT_FAILURE);
+            }
+            port = ntohs(address.sin_port);
+            worker = thread(&StubServer::run, this);
+        }
+
+        ~StubServer() {
+            stopping = true;
+            worker.join();
+            close(listener);
+        }
+
+        void setBody(const string &newBody) {
+            lock_guard<mutex> lock(bodyMutex);
+            body = newBody;
+        }
+
+        string url() const {
+            return "http://127.0.0.1:" + to_string(port) + "/v1/search?";
+        }
+
+    private:
+        void run() {
+            while (!stopping) {
+                pollfd ready{listener, POLLIN, 0};
+                if (poll(&ready, 1, 50) <= 0) {
+                    continue;
+                }
+                int client = accept(listener, nullptr, nullptr);
+                if (client < 0) {
+                    continue;
+                }
+                // Requests are small GETs; read until the end of the headers.
+                string request;
+                char buffer[4096];
+                ssize_t n;
+                while (request.find("\r\n\r\n") == string::npos &&
+                       (n = read(client, buffer, sizeof(buffer))) > 0) {
+                    request.append(buffer, n);
+                }
+                string current;
+                {
+                    lock_guard<mutex> lock(bodyMutex);
+                    current = body;
+                }
+                string response = "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: application/json\r\n"
+                                  "Connection: close\r\n"
+                                  "Content-Length: " + to_string(current.size()) +
+                                  "\r\n\r\n" + current;
+                if (write(client, response.data(), response.size()) < 0) {
+                    perror("stub server write");
+                }
+                close(client);
+            }
+        }
+
+        int listener = -1;
+        int port = 0;
+        atomic<bool> stopping{false};
+        mutex bodyMutex;
+        string body;
+        thread worker;
+    };
+
+    void waitUntilIdle(const ScanPipeline &pipeline) {
+        while (!pipeline.idle()) {
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+    }
+
+    struct Fixture {
+        StubServer server;
+        string directory;
+        vector<Kufar::KufarConfiguration> configurations{1};
+        vector<size_t> tenantOfConfiguration{0};
+        vector<Kufar::QueryPlan> plans;
+        vector<Tenant> tenants{1};
+        Telegram::Sender sender{Telegram::TelegramConfiguration(), 16};
+
+        Fixture() {
+            char pattern[] = "/tmp/ads-scanner-test-XXXXXX";
+            if (mkdtemp(pattern) == nullptr) {
+                perror("mkdtemp");
+                exit(EXIT_FAILURE);
+            }
+            directory = pattern;
+            plans = Kufar::compileQueryPlans(configurations, 60);
+            plans[0].url = server.url();
+            tenants[0].name = "test";
+            tenants[0].cacheJournal = make_unique<CacheJournal>(
+                directory + "/cache.json");
+            tenants[0].cacheJournal->load(tenants[0].seenAds);
+        }
+
+        ~Fixture() {
+            tenants[0].cacheJournal.reset();
+            remove((directory + "/cache.json").c_str());
+            remove((directory + "/cache.json.journal").c_str());
+            rmdir(directory.c_str());
+        }
+    };
+
+    // A body that failed to parse was never handled, so polling the same
+    // body again must parse it again instead of skipping it as unchanged.
+    void testFailedParseIsNotSkipped() {
+        Fixture fixture;
+        fixture.server.setBody("{\"unexpected\": true}");
+        ScanPipeline pipeline(fixture.configurations, fixture.tenantOfConfiguration,
+                              fixture.plans, fixture.tenants, fixture.sender,
+                              nullptr, nullptr, PipelineOptions());
+        pipeline.start();
+        for (int poll = 0; poll < 2; poll++) {
+            pipeline.fetch({0}, 1);
+            waitUntilIdle(pipeline);
+        }
+        vector<StageStats> stats = pipeline.stats();
+        pipeline.shutdown();
+
+        CHECK(stats[0].processed == 2);
+        CHECK(stats[0].skipped == 0);
+        CHECK(stats[1].failed == 2);
+    }
+
+    // A body that was diffed is skipped while it stays the same.
+    void testHandledBodyIsSkipped() {
+        Fixture fixture;
+        fixture.server.setBody("{\"ads\": []}");
+        ScanPipeline pipeline(fixture.configurations, fixture.tenantOfConfiguration,
+                              fixture.plans, fixture.tenants, fixture.sender,
+                              nullptr, nullptr, PipelineOptions());
+        pipeline.start();
+        for (int poll = 0; poll < 2; poll++) {
+            pipeline.fetch({0}, 1);
+            waitUntilIdle(pipeline);
+        }
+        vector<StageStats> stats = pipeline.stats();
+        pipeline.shutdown();
+
+        CHECK(stats[0].skipped == 1);
+        CHECK(stats[1].processed == 1);
+        CHECK(stats[2].processed == 1);
+    }
+}
+
+int main() {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    // Every poll must reach the stub server.
+    Networking::setReuseWindow(chrono::milliseconds(0));
+    testFailedParseIsNotSkipped();
+    testHandledBodyIsSkipped();
+    Networking::cleanupConnectionPool();
+    curl_global_cleanup();
+    if (g_failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", g_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
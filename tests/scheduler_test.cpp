@@ -0,0 +1,102 @@
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#include "scheduler.hpp"
+
+using namespace std;
+
+namespace {
+    int g_failures = 0;
+
+    void check(bool condition, const char *expression, const char *file, int line) {
+        if (!condition) {
+            fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+            g_failures++;
+        }
+    }
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+    double seconds(chrono::milliseconds interval) {
+        return interval.count() / 1000.0;
+    }
+
+    /** Give query a rate of roughly `arrivals` per 10 s on top of the prior. */
+    void feed(AdaptivePolicy &policy, size_t query, size_t arrivals,
+              QueryScheduler::Clock::time_point start) {
+        policy.observe(query, {1000}, start);
+        vector<time_t> listTimes;
+        for (size_t i = 0; i < arrivals; i++) {
+            listTimes.push_back(1001 + static_cast<time_t>(i));
+        }
+        policy.observe(query, listTimes, start + chrono::seconds(10));
+    }
+
+    // Query 0 is busy enough to be pinned at minInterval in the first
+    // round; its unused share must go to the idle query 1 instead of
+    // leaving it at maxInterval.
+    void testPinnedBudgetGoesToOthers() {
+        AdaptivePolicy policy(12, chrono::seconds(10), chrono::seconds(3600));
+        policy.resize(2);
+        feed(policy, 0, 100000, QueryScheduler::Clock::now());
+
+        auto estimates = policy.allocate();
+        CHECK(estimates.size() == 2);
+        CHECK(fabs(seconds(estimates[0].interval) - 10) < 0.01);
+        CHECK(fabs(seconds(estimates[1].interval) - 10) < 0.01);
+    }
+
+    // Quiet queries ahead of a busy one look starved until the busy one is
+    // pinned; they must not be pinned at maxInterval on that first look.
+    void testLowPinIsReconsidered() {
+        AdaptivePolicy policy(60, chrono::seconds(2), chrono::seconds(600));
+        policy.resize(4);
+        feed(policy, 3, 1000000, QueryScheduler::Clock::now());
+
+        auto estimates = policy.allocate();
+        CHECK(fabs(seconds(estimates[3].interval) - 2) < 0.01);
+        for (size_t query = 0; query < 3; query++) {
+            CHECK(fabs(seconds(estimates[query].interval) - 6) < 0.01);
+        }
+    }
+
+    // Without pins the budget is split in proportion to sqrt(rate).
+    void testSplitsBySquareRootOfRate() {
+        AdaptivePolicy policy(6, chrono::seconds(1), chrono::seconds(86400));
+        policy.resize(2);
+        auto start = QueryScheduler::Clock::now();
+        feed(policy, 0, 400, start);
+        feed(policy, 1, 100, start);
+
+        auto estimates = policy.allocate();
+        double ratio = seconds(estimates[1].interval) / seconds(estimates[0].interval);
+        CHECK(fabs(ratio - sqrt(400.0 / 100.0)) < 0.01);
+        double total = 1 / seconds(estimates[0].interval) +
+                       1 / seconds(estimates[1].interval);
+        CHECK(fabs(total - 0.1) < 0.001);
+    }
+
+    // A budget too small for every query still keeps each at maxInterval.
+    void testBudgetBelowMaxInterval() {
+        AdaptivePolicy policy(0.01, chrono::seconds(10), chrono::seconds(3600));
+        policy.resize(3);
+        for (const auto &estimate : policy.allocate()) {
+            CHECK(estimate.interval == chrono::milliseconds(3600 * 1000));
+        }
+    }
+}
+
+int main() {
+    testPinnedBudgetGoesToOthers();
+    testLowPinIsReconsidered();
+    testSplitsBySquareRootOfRate();
+    testBudgetBelowMaxInterval();
+    if (g_failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", g_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}